@@ -0,0 +1,125 @@
+#include "datastream.h"
+#include "levelfile.h"
+#include "material.h"
+#include "octree.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <optional>
+
+namespace {
+
+// enough for the visibility sets of small enclosed levels not to miss gaps
+constexpr auto DefaultVisibilitySampleCount = 1024;
+
+std::optional<Octree::BuildParams> parseBuildParams(int argc, char *argv[], int &argIndex, bool &autoTune)
+{
+    Octree::BuildParams params;
+    params.visibilitySampleCount = DefaultVisibilitySampleCount;
+    for (; argIndex < argc && std::strncmp(argv[argIndex], "--", 2) == 0; ++argIndex) {
+        const auto *option = argv[argIndex];
+        if (std::strcmp(option, "--auto-tune") == 0) {
+            autoTune = true;
+        } else if (std::strcmp(option, "--morton") == 0) {
+            params.method = Octree::BuildMethod::Morton;
+        } else if (std::strcmp(option, "--clipped") == 0) {
+            params.storage = Octree::TriangleStorage::Clipped;
+        } else if (argIndex + 1 < argc && std::strcmp(option, "--max-faces-per-leaf") == 0) {
+            params.maxFacesPerLeaf = std::max(1, std::atoi(argv[++argIndex]));
+        } else if (argIndex + 1 < argc && std::strcmp(option, "--max-depth") == 0) {
+            params.maxDepth = std::atoi(argv[++argIndex]);
+        } else if (argIndex + 1 < argc && std::strcmp(option, "--traversal-cost") == 0) {
+            params.traversalCost = std::atof(argv[++argIndex]);
+        } else if (argIndex + 1 < argc && std::strcmp(option, "--visibility-samples") == 0) {
+            params.visibilitySampleCount = std::max(0, std::atoi(argv[++argIndex]));
+        } else {
+            return {};
+        }
+    }
+    return params;
+}
+
+} // namespace
+
+// Appends a prebuilt octree to a level file so that the game doesn't have to
+// build it at load time. Running it again on a baked level replaces the
+// octree. Levels too large or too small for the default build parameters can
+// set them on the command line or have them tuned.
+int main(int argc, char *argv[])
+{
+    int argIndex = 1;
+    bool autoTune = false;
+    auto params = parseBuildParams(argc, argv, argIndex, autoTune);
+    if (!params || argc - argIndex != 2) {
+        spdlog::error("Usage: {} [--auto-tune] [--morton] [--clipped] [--max-faces-per-leaf <n>] [--max-depth <n>] [--traversal-cost <cost>] [--visibility-samples <n>] <level.z3d> <baked-level.z3d>", argv[0]);
+        return 1;
+    }
+
+    const auto *inputPath = argv[argIndex];
+    const auto *outputPath = argv[argIndex + 1];
+
+    std::vector<LevelMesh> meshes;
+    std::vector<char> meshBytes;
+    {
+        DataStream ds(inputPath);
+        if (!ds || !readLevelMeshes(ds, meshes)) {
+            spdlog::error("Failed to read level file {}", inputPath);
+            return 1;
+        }
+        meshBytes.resize(ds.position());
+    }
+    {
+        // everything after the meshes is a previously baked octree, drop it
+        DataStream ds(inputPath);
+        ds.readBytes(meshBytes.data(), meshBytes.size());
+        if (!ds) {
+            spdlog::error("Failed to read level file {}", inputPath);
+            return 1;
+        }
+    }
+
+    // Materials only tell meshes apart here, so they don't load any textures.
+    // Meshes get the same material when cachedMaterial would give them the
+    // same one at runtime.
+    std::vector<std::unique_ptr<Material>> materialStorage;
+    std::vector<const Material *> materials;
+    for (std::size_t i = 0; i < meshes.size(); ++i) {
+        const auto &key = meshes[i].materialKey;
+        const auto it = std::find_if(meshes.begin(), meshes.begin() + i, [&key](const LevelMesh &mesh) {
+            return mesh.materialKey == key;
+        });
+        if (it != meshes.begin() + i) {
+            materials.push_back(materials[std::distance(meshes.begin(), it)]);
+        } else {
+            materialStorage.push_back(std::make_unique<Material>(key.program));
+            materials.push_back(materialStorage.back().get());
+        }
+    }
+
+    const auto faces = levelFaces(meshes, materials);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    if (autoTune) {
+        params = Octree::tuneBuildParams(faces, *params);
+        spdlog::info("Tuned build parameters: {} faces per leaf, traversal cost {}", params->maxFacesPerLeaf, params->traversalCost);
+    }
+
+    DataWriter dw(outputPath);
+    dw.writeBytes(meshBytes.data(), meshBytes.size());
+    Octree::write(dw, faces, materials, *params);
+    if (!dw) {
+        spdlog::error("Failed to write level file {}", outputPath);
+        return 1;
+    }
+
+    const auto elapsed = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    spdlog::info("Baked octree for {} faces into {} in {:.1f} ms", faces.size(), outputPath, elapsed);
+
+    return 0;
+}
@@ -0,0 +1,731 @@
+#include "benchmark.h"
+
+#include "bvh.h"
+#include "distancefield.h"
+#include "gameobject.h"
+#include "level.h"
+#include "looseoctree.h"
+#include "navgraph.h"
+#include "octree.h"
+#include "packedtriangles.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <future>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+template<typename F>
+double elapsedMilliseconds(F &&f)
+{
+    const auto start = Clock::now();
+    f();
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+const char *kernelName(TriangleKernel kernel)
+{
+    switch (kernel) {
+    case TriangleKernel::Scalar:
+        return "scalar";
+    case TriangleKernel::SSE:
+        return "sse";
+    case TriangleKernel::AVX2:
+        return "avx2";
+    }
+    return "?";
+}
+
+const char *layoutName(TriangleLayout layout)
+{
+    switch (layout) {
+    case TriangleLayout::Edges:
+        return "edges";
+    case TriangleLayout::Projected:
+        return "projected";
+    }
+    return "?";
+}
+
+BoundingBox boundingBox(const std::vector<Face> &faces)
+{
+    BoundingBox box;
+    for (const auto &face : faces) {
+        for (const auto &vertex : face.vertices)
+            box |= vertex.position;
+    }
+    return box;
+}
+
+// Mix of short segments (bullets) and long ones spanning the whole level.
+std::vector<LineSegment> randomSegments(const BoundingBox &box, int count)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const auto size = box.max - box.min;
+    const auto randomPoint = [&] {
+        return box.min + glm::vec3(unit(rng), unit(rng), unit(rng)) * size;
+    };
+    const auto shortLength = 0.02f * glm::length(size);
+
+    std::vector<LineSegment> segments;
+    segments.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        const auto from = randomPoint();
+        if (i % 2 == 0) {
+            segments.push_back({ from, randomPoint() });
+        } else {
+            const auto direction = glm::normalize(randomPoint() - from + glm::vec3(1e-3f));
+            segments.push_back({ from, from + shortLength * direction });
+        }
+    }
+    return segments;
+}
+
+Face triangle(const glm::vec3 &p0, const glm::vec3 &p1, const glm::vec3 &p2)
+{
+    const auto normal = glm::normalize(glm::cross(p1 - p0, p2 - p0));
+    return Face { nullptr, { { p0, normal, {} }, { p1, normal, {} }, { p2, normal, {} } } };
+}
+
+Face quad(const glm::vec3 &p0, const glm::vec3 &p1, const glm::vec3 &p2, const glm::vec3 &p3)
+{
+    const auto normal = glm::normalize(glm::cross(p1 - p0, p2 - p0));
+    return Face { nullptr, { { p0, normal, {} }, { p1, normal, {} }, { p2, normal, {} }, { p3, normal, {} } } };
+}
+
+// Heightfield with most of its detail packed into one corner, to get the
+// uneven triangle density the octree handles poorly.
+std::vector<Face> syntheticTerrain(int size)
+{
+    const auto height = [size](int i, int j) {
+        const auto x = static_cast<float>(i) / size;
+        const auto z = static_cast<float>(j) / size;
+        return 4.0f * std::sin(40.0f * x * x) * std::cos(40.0f * z * z);
+    };
+    const auto vertex = [size, &height](int i, int j) {
+        // cluster grid lines towards the origin
+        const auto x = static_cast<float>(i) / size;
+        const auto z = static_cast<float>(j) / size;
+        return glm::vec3(100.0f * x * x, height(i, j), 100.0f * z * z);
+    };
+
+    // split cells into triangles, terrain quads aren't planar
+    std::vector<Face> faces;
+    faces.reserve(2 * size * size);
+    for (int i = 0; i < size; ++i) {
+        for (int j = 0; j < size; ++j) {
+            faces.push_back(triangle(vertex(i, j), vertex(i, j + 1), vertex(i + 1, j + 1)));
+            faces.push_back(triangle(vertex(i, j), vertex(i + 1, j + 1), vertex(i + 1, j)));
+        }
+    }
+    return faces;
+}
+
+// Randomly oriented small quads scattered in clusters.
+std::vector<Face> syntheticDebris(int count)
+{
+    std::mt19937 rng(4321);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    const auto randomVector = [&] {
+        return glm::vec3(unit(rng), unit(rng), unit(rng));
+    };
+
+    constexpr auto ClusterCount = 16;
+    std::vector<glm::vec3> clusters(ClusterCount);
+    std::generate(clusters.begin(), clusters.end(), [&] { return 100.0f * randomVector(); });
+
+    std::vector<Face> faces;
+    faces.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        const auto center = clusters[i % ClusterCount] + 10.0f * randomVector() * std::abs(unit(rng));
+        const auto u = 0.5f * randomVector();
+        const auto v = 0.5f * randomVector();
+        faces.push_back(quad(center - u - v, center + u - v, center + u + v, center - u + v));
+    }
+    return faces;
+}
+
+const char *storageName(Octree::TriangleStorage storage)
+{
+    switch (storage) {
+    case Octree::TriangleStorage::Referenced:
+        return "referenced";
+    case Octree::TriangleStorage::Clipped:
+        return "clipped";
+    }
+    return "?";
+}
+
+void benchmarkLevel(const char *name, const std::vector<Face> &faces)
+{
+    constexpr auto QueryCount = 100000;
+
+    const auto triangles = triangulate(faces);
+    const auto segments = randomSegments(boundingBox(faces), QueryCount);
+
+    BVH bvh;
+    const auto bvhBuildTime = elapsedMilliseconds([&] { bvh.initialize(triangles); });
+
+    std::vector<std::optional<glm::vec3>> bvhHits(segments.size());
+    const auto bvhQueryTime = elapsedMilliseconds([&] {
+        std::transform(segments.begin(), segments.end(), bvhHits.begin(), [&bvh](const LineSegment &segment) {
+            return bvh.findCollision(segment);
+        });
+    });
+
+    const auto hitCount = std::count_if(bvhHits.begin(), bvhHits.end(), [](const auto &hit) { return hit.has_value(); });
+    spdlog::info("{}: {} triangles, {} queries, {} hits", name, triangles.size(), segments.size(), hitCount);
+    spdlog::info("  bvh: build {:.1f} ms, {} nodes, {:.0f} queries/s", bvhBuildTime, bvh.nodeCount(), 1000.0 * segments.size() / bvhQueryTime);
+
+    // tuning builds the tree a dozen times, too slow for the largest levels
+    constexpr auto MaxTunedTriangles = 150000;
+
+    std::vector<std::pair<std::string, Octree::BuildParams>> candidates;
+    for (const auto storage : { Octree::TriangleStorage::Referenced, Octree::TriangleStorage::Clipped }) {
+        Octree::BuildParams params;
+        params.storage = storage;
+        candidates.emplace_back(storageName(storage), params);
+    }
+    {
+        Octree::BuildParams params;
+        params.method = Octree::BuildMethod::Morton;
+        candidates.emplace_back("morton", params);
+    }
+    if (triangles.size() <= MaxTunedTriangles) {
+        const auto params = Octree::tuneBuildParams(faces, Octree::BuildParams());
+        candidates.emplace_back(fmt::format("tuned: {} faces per leaf, traversal cost {}", params.maxFacesPerLeaf, params.traversalCost), params);
+    }
+
+    for (const auto &candidate : candidates) {
+        Octree octree;
+        const auto octreeBuildTime = elapsedMilliseconds([&] { octree.initialize(faces, candidate.second); });
+
+        for (const auto layout : { TriangleLayout::Edges, TriangleLayout::Projected }) {
+            octree.setTriangleLayout(layout);
+
+            std::vector<std::optional<glm::vec3>> octreeHits(segments.size());
+            const auto octreeQueryTime = elapsedMilliseconds([&] {
+                std::transform(segments.begin(), segments.end(), octreeHits.begin(), [&octree](const LineSegment &segment) {
+                    return octree.findCollision(segment);
+                });
+            });
+
+            Octree::QueryStats octreeStats;
+            for (const auto &segment : segments)
+                octree.findCollision(segment, &octreeStats);
+
+            int mismatchCount = 0;
+            for (std::size_t i = 0; i < segments.size(); ++i) {
+                const auto &a = octreeHits[i];
+                const auto &b = bvhHits[i];
+                if (a.has_value() != b.has_value() || (a && glm::length(*a - *b) > 1e-3f))
+                    ++mismatchCount;
+            }
+
+            spdlog::info("  octree ({}, {}): build {:.1f} ms, {} nodes of {} bytes, {} KiB, {:.0f} queries/s, {:.1f} nodes/query, {:.1f} triangles/query, {} mismatches", candidate.first,
+                         layoutName(layout), octreeBuildTime, octree.nodeCount(), Octree::nodeSize(), octree.collisionMemoryUsage() / 1024, 1000.0 * segments.size() / octreeQueryTime,
+                         static_cast<double>(octreeStats.nodesVisited) / segments.size(), static_cast<double>(octreeStats.trianglesTested) / segments.size(), mismatchCount);
+        }
+    }
+}
+
+} // namespace
+
+void benchmarkCollisionBackends(const std::vector<Face> &faces)
+{
+    benchmarkLevel("level", faces);
+    for (const auto size : { 64, 256, 512 }) {
+        benchmarkLevel(fmt::format("terrain {}x{}", size, size).c_str(), syntheticTerrain(size));
+    }
+    for (const auto count : { 10000, 50000 }) {
+        benchmarkLevel(fmt::format("debris {}", count).c_str(), syntheticDebris(count));
+    }
+}
+
+void benchmarkTriangleKernels(const std::vector<Triangle> &triangles)
+{
+    constexpr auto SegmentCount = 2000;
+
+    BoundingBox box;
+    for (const auto &triangle : triangles)
+        box |= triangle.v0;
+    const auto segments = randomSegments(box, SegmentCount);
+
+    std::vector<std::optional<float>> expected(segments.size());
+    const auto scalarTime = elapsedMilliseconds([&] {
+        std::transform(segments.begin(), segments.end(), expected.begin(), [&triangles](const LineSegment &segment) {
+            std::optional<float> collisionT;
+            for (const auto &triangle : triangles) {
+                if (const auto ot = segment.intersection(triangle)) {
+                    if (!collisionT || *ot < *collisionT)
+                        collisionT = *ot;
+                }
+            }
+            return collisionT;
+        });
+    });
+
+    const auto testCount = static_cast<double>(segments.size()) * triangles.size();
+    spdlog::info("triangle kernels: {} triangles, {} segments", triangles.size(), segments.size());
+    spdlog::info("  aos: {:.2f} ns/test", 1e6 * scalarTime / testCount);
+
+    PackedTriangles packed;
+    packed.setLayout(TriangleLayout::Projected);
+    for (const auto &triangle : triangles)
+        packed.append(triangle);
+
+    for (const auto layout : { TriangleLayout::Edges, TriangleLayout::Projected }) {
+        for (const auto kernel : { TriangleKernel::Scalar, TriangleKernel::SSE, TriangleKernel::AVX2 }) {
+            if (!isSupported(kernel))
+                continue;
+
+            std::vector<std::optional<float>> result(segments.size());
+            const auto time = elapsedMilliseconds([&] {
+                std::transform(segments.begin(), segments.end(), result.begin(), [&packed, layout, kernel](const LineSegment &segment) -> std::optional<float> {
+                    auto t = std::nextafter(1.0f, 2.0f);
+                    const auto hit = layout == TriangleLayout::Projected
+                            ? intersectTriangleBlocks(kernel, packed.projectedBlocks(), packed.blockCount(), segment.ray(), t)
+                            : intersectTriangleBlocks(kernel, packed.blocks(), packed.blockCount(), segment.ray(), t);
+                    if (!hit)
+                        return {};
+                    return t;
+                });
+            });
+
+            int mismatchCount = 0;
+            for (std::size_t i = 0; i < segments.size(); ++i) {
+                const auto &a = expected[i];
+                const auto &b = result[i];
+                if (a.has_value() != b.has_value() || (a && std::abs(*a - *b) > 1e-5f))
+                    ++mismatchCount;
+            }
+
+            spdlog::info("  {} {}: {:.2f} ns/test, {:.1f}x, {} mismatches", kernelName(kernel), layoutName(layout), 1e6 * time / testCount, scalarTime / time, mismatchCount);
+        }
+    }
+}
+
+void benchmarkClosestPoints(const std::vector<Face> &faces)
+{
+    constexpr auto PointCount = 20000;
+
+    const auto benchmark = [](const char *name, const std::vector<Face> &faces) {
+        const auto triangles = triangulate(faces);
+        const auto box = boundingBox(faces);
+        // about the size of a ship's surroundings
+        const auto maxDistance = 0.05f * glm::length(box.max - box.min);
+
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        std::vector<glm::vec3> points(PointCount);
+        std::generate(points.begin(), points.end(), [&] {
+            return box.min + glm::vec3(unit(rng), unit(rng), unit(rng)) * (box.max - box.min);
+        });
+
+        Octree octree;
+        octree.initialize(faces);
+
+        const auto bruteForceCount = std::min<std::size_t>(points.size(), 10000000 / std::max<std::size_t>(triangles.size(), 1));
+        std::vector<std::optional<float>> expected(bruteForceCount);
+        const auto bruteForceTime = elapsedMilliseconds([&] {
+            std::transform(points.begin(), points.begin() + bruteForceCount, expected.begin(), [&](const glm::vec3 &point) {
+                std::optional<float> distance;
+                for (const auto &triangle : triangles) {
+                    const auto d = glm::length(triangle.closestPoint(point) - point);
+                    if (d <= maxDistance && (!distance || d < *distance))
+                        distance = d;
+                }
+                return distance;
+            });
+        });
+
+        std::vector<std::optional<glm::vec3>> closest(points.size());
+        const auto singleTime = elapsedMilliseconds([&] {
+            std::transform(points.begin(), points.end(), closest.begin(), [&](const glm::vec3 &point) {
+                return octree.closestPoint(point, maxDistance);
+            });
+        });
+        std::vector<std::optional<glm::vec3>> batchClosest;
+        Octree::QueryStats stats;
+        const auto batchTime = elapsedMilliseconds([&] { octree.closestPoints(points, maxDistance, batchClosest, &stats); });
+
+        int mismatchCount = 0;
+        for (std::size_t i = 0; i < points.size(); ++i) {
+            if (closest[i].has_value() != batchClosest[i].has_value() || (closest[i] && *closest[i] != *batchClosest[i]))
+                ++mismatchCount;
+            if (i < expected.size()) {
+                const auto distance = closest[i] ? std::optional<float>(glm::length(*closest[i] - points[i])) : std::nullopt;
+                if (distance.has_value() != expected[i].has_value() || (distance && std::abs(*distance - *expected[i]) > 1e-3f))
+                    ++mismatchCount;
+            }
+        }
+
+        const auto hitCount = std::count_if(closest.begin(), closest.end(), [](const auto &point) { return point.has_value(); });
+        spdlog::info("{}: {} triangles, {} points, max distance {:.1f}, {} found", name, triangles.size(), points.size(), maxDistance, hitCount);
+        spdlog::info("  brute force: {:.0f} queries/s, octree: {:.0f} queries/s, batch: {:.0f} queries/s, {:.1f} nodes/query, {:.1f} triangles/query, {} mismatches",
+                     1000.0 * bruteForceCount / bruteForceTime, 1000.0 * points.size() / singleTime, 1000.0 * points.size() / batchTime,
+                     static_cast<double>(stats.nodesVisited) / points.size(), static_cast<double>(stats.trianglesTested) / points.size(), mismatchCount);
+    };
+
+    benchmark("level", faces);
+    benchmark("terrain 256x256", syntheticTerrain(256));
+    benchmark("debris 10000", syntheticDebris(10000));
+}
+
+void benchmarkDistanceField(const std::vector<Face> &faces, float bandWidth)
+{
+    constexpr auto PointCount = 100000;
+
+    const auto triangles = triangulate(faces);
+    Octree octree;
+    octree.initialize(faces);
+
+    // points within the band of the geometry, where the field matters
+    const auto box = octree.boundingBox();
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<glm::vec3> points;
+    while (points.size() < PointCount) {
+        const auto point = box.min - glm::vec3(bandWidth) + glm::vec3(unit(rng), unit(rng), unit(rng)) * (box.max - box.min + glm::vec3(2.0f * bandWidth));
+        if (octree.closestPoint(point, bandWidth))
+            points.push_back(point);
+    }
+
+    std::vector<std::optional<glm::vec3>> closest;
+    const auto closestTime = elapsedMilliseconds([&] { octree.closestPoints(points, bandWidth, closest); });
+    spdlog::info("Distance field: {} triangles, band width {:.1f}, closest point queries: {:.0f} queries/s", triangles.size(), bandWidth, 1000.0 * points.size() / closestTime);
+
+    for (const auto voxelSize : { 0.5f, 0.25f, 0.125f }) {
+        DistanceField field;
+        const auto buildTime = elapsedMilliseconds([&] { field.initialize(triangles, voxelSize, bandWidth); });
+
+        std::vector<float> distances(points.size());
+        const auto distanceTime = elapsedMilliseconds([&] {
+            std::transform(points.begin(), points.end(), distances.begin(), [&](const glm::vec3 &point) { return field.distance(point); });
+        });
+        std::vector<glm::vec3> gradients(points.size());
+        const auto gradientTime = elapsedMilliseconds([&] {
+            std::transform(points.begin(), points.end(), gradients.begin(), [&](const glm::vec3 &point) { return field.gradient(point); });
+        });
+
+        double errorSum = 0.0;
+        float maxError = 0.0f;
+        for (std::size_t i = 0; i < points.size(); ++i) {
+            const auto error = std::abs(distances[i] - glm::length(*closest[i] - points[i]));
+            errorSum += error;
+            maxError = std::max(maxError, error);
+        }
+
+        spdlog::info("  voxel size {:.3f}: {:.1f} ms to build, {} bricks, {:.1f} KiB, {:.0f} distances/s, {:.0f} gradients/s, mean error {:.4f}, max error {:.4f}",
+                     voxelSize, buildTime, field.brickCount(), field.memoryUsage() / 1024.0, 1000.0 * points.size() / distanceTime, 1000.0 * points.size() / gradientTime,
+                     errorSum / points.size(), maxError);
+    }
+}
+
+void benchmarkLooseOctree(const BoundingBox &bounds)
+{
+    constexpr auto BulletCount = 200;
+    constexpr auto TickCount = 100;
+    constexpr auto BulletLength = 2.0f;
+
+    struct Object {
+        glm::vec3 center;
+        glm::vec3 velocity;
+        float radius;
+        LooseOctree<int>::Handle handle;
+    };
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const auto size = bounds.max - bounds.min;
+    const auto randomPoint = [&] {
+        return bounds.min + glm::vec3(unit(rng), unit(rng), unit(rng)) * size;
+    };
+    const auto randomDirection = [&] {
+        return glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) - glm::vec3(0.5f) + glm::vec3(1e-3f));
+    };
+    const auto overlaps = [](const LineSegment &segment, const Object &object) {
+        const auto d = segment.closestPoint(object.center) - object.center;
+        return glm::dot(d, d) <= object.radius * object.radius;
+    };
+
+    for (const auto objectCount : { 10, 100, 1000 }) {
+        LooseOctree<int> index(bounds);
+        std::vector<Object> objects(objectCount);
+        for (int i = 0; i < objectCount; ++i) {
+            auto &object = objects[i];
+            object.center = randomPoint();
+            object.velocity = 0.2f * randomDirection();
+            object.radius = 1.0f + 2.0f * unit(rng);
+            object.handle = index.insert(i, object.center, object.radius);
+        }
+
+        double bruteForceTime = 0.0, indexTime = 0.0;
+        std::size_t bruteForcePairs = 0, indexPairs = 0;
+        for (int tick = 0; tick < TickCount; ++tick) {
+            for (auto &object : objects)
+                object.center += object.velocity;
+
+            std::vector<LineSegment> bullets(BulletCount);
+            std::generate(bullets.begin(), bullets.end(), [&] {
+                const auto from = randomPoint();
+                return LineSegment { from, from + BulletLength * randomDirection() };
+            });
+
+            bruteForceTime += elapsedMilliseconds([&] {
+                for (const auto &bullet : bullets) {
+                    for (const auto &object : objects)
+                        bruteForcePairs += overlaps(bullet, object);
+                }
+            });
+            indexTime += elapsedMilliseconds([&] {
+                for (const auto &object : objects)
+                    index.move(object.handle, object.center, object.radius);
+                for (const auto &bullet : bullets)
+                    index.query(bullet, [&indexPairs](int) { ++indexPairs; });
+            });
+        }
+
+        spdlog::info("loose octree: {} objects, {} bullets, {} ticks, {} pairs{}", objectCount, BulletCount, TickCount, bruteForcePairs,
+                     indexPairs == bruteForcePairs ? "" : fmt::format(" (index found {})", indexPairs));
+        spdlog::info("  brute force: {:.1f} us/tick, index with updates: {:.1f} us/tick", 1000.0 * bruteForceTime / TickCount, 1000.0 * indexTime / TickCount);
+    }
+}
+
+void benchmarkPathQueries(const Level &level, float clearance, float minCellSize)
+{
+    constexpr auto QueryCount = 2000;
+    constexpr auto FoeCount = 100;
+    constexpr auto TargetCount = 4;
+    constexpr auto TickCount = 100;
+
+    NavGraph graph;
+    const auto buildTime = elapsedMilliseconds([&] { graph.initialize(level, clearance, minCellSize); });
+    spdlog::info("Navigation graph: clearance {:.2f}, min cell size {:.2f}, {:.1f} ms to build, {} cells, {} links",
+                 clearance, minCellSize, buildTime, graph.cellCount(), graph.linkCount());
+    if (graph.cellCount() == 0)
+        return;
+
+    const auto box = level.boundingBox();
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const auto randomFreePoint = [&] {
+        for (;;) {
+            const auto point = box.min + glm::vec3(unit(rng), unit(rng), unit(rng)) * (box.max - box.min);
+            if (!level.closestPoint(point, clearance))
+                return point;
+        }
+    };
+
+    // paths only go through clear cells, so their segments shouldn't cross
+    // the geometry
+    std::size_t blockedSegmentCount = 0;
+    const auto checkPath = [&](const std::vector<glm::vec3> &path) {
+        for (std::size_t i = 1; i < path.size(); ++i)
+            blockedSegmentCount += level.isOccluded({ path[i - 1], path[i] });
+    };
+
+    {
+        std::vector<std::pair<glm::vec3, glm::vec3>> queries(QueryCount);
+        std::generate(queries.begin(), queries.end(), [&] { return std::make_pair(randomFreePoint(), randomFreePoint()); });
+
+        PathPlanner planner(&graph, 1);
+        std::vector<std::vector<glm::vec3>> paths(queries.size());
+        std::size_t foundCount = 0;
+        const auto time = elapsedMilliseconds([&] {
+            for (std::size_t i = 0; i < queries.size(); ++i)
+                foundCount += planner.findPath(queries[i].first, queries[i].second, paths[i]);
+        });
+        for (const auto &path : paths)
+            checkPath(path);
+        const auto &stats = planner.stats();
+        spdlog::info("  random pairs: {:.0f} queries/s, {} found, {:.1f} cells expanded/query, {} blocked segments",
+                     1000.0 * queries.size() / time, foundCount, static_cast<double>(stats.cellsExpanded) / stats.queryCount, blockedSegmentCount);
+    }
+
+    {
+        std::vector<glm::vec3> foes(FoeCount);
+        std::generate(foes.begin(), foes.end(), randomFreePoint);
+        std::vector<glm::vec3> targets(TargetCount);
+        std::generate(targets.begin(), targets.end(), randomFreePoint);
+
+        PathPlanner planner(&graph, TargetCount);
+        std::vector<glm::vec3> path;
+        std::size_t foundCount = 0;
+        double time = 0.0, maxTickTime = 0.0;
+        blockedSegmentCount = 0;
+        for (int tick = 0; tick < TickCount; ++tick) {
+            // targets wander around, foes move along their paths
+            for (auto &target : targets) {
+                const auto step = target + 0.2f * (glm::vec3(unit(rng), unit(rng), unit(rng)) - glm::vec3(0.5f));
+                if (!level.closestPoint(step, clearance))
+                    target = step;
+            }
+            const auto tickTime = elapsedMilliseconds([&] {
+                for (std::size_t i = 0; i < foes.size(); ++i) {
+                    if (planner.findPath(foes[i], targets[i % TargetCount], path)) {
+                        ++foundCount;
+                        const auto offset = path[1] - path[0];
+                        const auto length = glm::length(offset);
+                        if (length > 0.0f)
+                            foes[i] += std::min(length, 0.1f) / length * offset;
+                    }
+                }
+            });
+            checkPath(path);
+            time += tickTime;
+            maxTickTime = std::max(maxTickTime, tickTime);
+        }
+        const auto &stats = planner.stats();
+        spdlog::info("  {} foes chasing {} targets: {:.0f} queries/s, {} found, {:.1f}% searched, {:.1f} cells expanded/query, {:.2f} ms max per tick, {} blocked segments",
+                     FoeCount, TargetCount, 1000.0 * stats.queryCount / time, foundCount, 100.0 * stats.searchCount / stats.queryCount,
+                     static_cast<double>(stats.cellsExpanded) / stats.queryCount, maxTickTime, blockedSegmentCount);
+    }
+}
+
+void benchmarkOctreeUpdates(const std::vector<Face> &faces)
+{
+    constexpr auto QueryCount = 20000;
+
+    const auto benchmark = [](const char *name, std::vector<Face> faces) {
+        const auto segments = randomSegments(boundingBox(faces), QueryCount);
+
+        Octree octree;
+        const auto buildTime = elapsedMilliseconds([&] { octree.initialize(faces); });
+        spdlog::info("{}: {} faces, build {:.1f} ms, {} nodes", name, faces.size(), buildTime, octree.nodeCount());
+
+        std::mt19937 rng(1234);
+        for (const std::size_t editSize : { 1, 10, 100 }) {
+            // a hole in the level: the faces closest to a random one
+            const auto centroid = [](const Face &face) {
+                glm::vec3 sum(0.0f);
+                for (const auto &vertex : face.vertices)
+                    sum += vertex.position;
+                return sum / std::max<float>(face.vertices.size(), 1.0f);
+            };
+            std::vector<uint32_t> candidates;
+            for (uint32_t i = 0; i < faces.size(); ++i) {
+                if (!faces[i].vertices.empty())
+                    candidates.push_back(i);
+            }
+            const auto center = centroid(faces[candidates[rng() % candidates.size()]]);
+            const auto count = std::min(editSize, candidates.size());
+            std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(), [&](uint32_t a, uint32_t b) {
+                return glm::length(centroid(faces[a]) - center) < glm::length(centroid(faces[b]) - center);
+            });
+            const std::vector<uint32_t> removedFaces(candidates.begin(), candidates.begin() + count);
+            std::vector<Face> addedFaces;
+            for (const auto face : removedFaces)
+                addedFaces.push_back(faces[face]);
+
+            // removing the faces, then putting them back as new ones
+            const auto edit = [&](const std::vector<uint32_t> &removed, const std::vector<Face> &added) {
+                std::unique_ptr<Octree::Update> update;
+                const auto prepareTime = elapsedMilliseconds([&] { update = octree.prepareUpdate(faces, removed, added, Octree::BuildParams()); });
+                if (!update) {
+                    spdlog::warn("  octree can't be updated");
+                    return;
+                }
+                const auto applyTime = elapsedMilliseconds([&] { octree.applyUpdate(*update); });
+                for (const auto face : removed)
+                    faces[face].vertices.clear();
+                faces.insert(faces.end(), added.begin(), added.end());
+
+                Octree rebuilt;
+                const auto rebuildTime = elapsedMilliseconds([&] { rebuilt.initialize(faces); });
+                int mismatchCount = 0;
+                for (const auto &segment : segments) {
+                    const auto a = octree.findCollision(segment);
+                    const auto b = rebuilt.findCollision(segment);
+                    if (a.has_value() != b.has_value() || (a && glm::length(*a - *b) > 1e-3f))
+                        ++mismatchCount;
+                }
+                spdlog::info("  {} {} faces: prepare {:.2f} ms, apply {:.2f} ms, full build {:.1f} ms, {} nodes, {} mismatches",
+                             removed.empty() ? "adding" : "removing", removed.empty() ? added.size() : removed.size(), prepareTime, applyTime, rebuildTime,
+                             octree.nodeCount(), mismatchCount);
+            };
+            edit(removedFaces, {});
+            edit({}, addedFaces);
+        }
+    };
+
+    benchmark("level", faces);
+    benchmark("terrain 256x256", syntheticTerrain(256));
+}
+
+void benchmarkConcurrentQueries(const Level &level, const GameObject &object)
+{
+    constexpr auto QueryCount = 100000;
+    constexpr auto RunCount = 3;
+
+    using Query = std::function<std::optional<glm::vec3>(const LineSegment &)>;
+    struct Workload {
+        const char *name;
+        Query query;
+        std::vector<LineSegment> segments;
+        std::vector<std::optional<glm::vec3>> expected;
+        double singleThreadTime = 0.0;
+    };
+    const auto radius = object.boundingRadius();
+    const auto objectBox = BoundingBox { object.position() - glm::vec3(radius), object.position() + glm::vec3(radius) };
+    std::array<Workload, 2> workloads = { {
+        { "level", [&level](const LineSegment &segment) { return level.findCollision(segment); }, randomSegments(level.boundingBox(), QueryCount), {} },
+        { "object", [&object](const LineSegment &segment) { return object.findCollision(segment); }, randomSegments(objectBox, QueryCount), {} },
+    } };
+
+    // Every thread gets a range of the segments. Results of a single thread
+    // are the reference; each run has to find the same ones, threads racing
+    // on some shared state would show up as mismatches or crashes.
+    const auto run = [](const Workload &workload, unsigned threadCount, std::vector<std::optional<glm::vec3>> &results) {
+        const auto &segments = workload.segments;
+        results.assign(segments.size(), std::nullopt);
+        return elapsedMilliseconds([&] {
+            std::vector<std::future<void>> tasks;
+            for (unsigned thread = 0; thread < threadCount; ++thread) {
+                const auto begin = segments.size() * thread / threadCount;
+                const auto end = segments.size() * (thread + 1) / threadCount;
+                tasks.push_back(std::async(std::launch::async, [&workload, &segments, &results, begin, end] {
+                    for (auto i = begin; i < end; ++i)
+                        results[i] = workload.query(segments[i]);
+                }));
+            }
+            for (auto &task : tasks)
+                task.get();
+        });
+    };
+
+    for (auto &workload : workloads) {
+        workload.singleThreadTime = run(workload, 1, workload.expected);
+        const auto hitCount = std::count_if(workload.expected.begin(), workload.expected.end(), [](const auto &hit) { return hit.has_value(); });
+        spdlog::info("{}: {} queries, {} hits", workload.name, workload.segments.size(), hitCount);
+    }
+
+    const auto maxThreadCount = 2 * std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned threadCount = 1; threadCount <= maxThreadCount; threadCount *= 2) {
+        for (const auto &workload : workloads) {
+            auto time = std::numeric_limits<double>::max();
+            int mismatchCount = 0;
+            std::vector<std::optional<glm::vec3>> results;
+            for (int i = 0; i < RunCount; ++i) {
+                time = std::min(time, run(workload, threadCount, results));
+                mismatchCount += std::inner_product(results.begin(), results.end(), workload.expected.begin(), 0, std::plus<>(), std::not_equal_to<>());
+            }
+            spdlog::info("  {} threads, {}: {:.0f} queries/s, {:.2f}x one thread, {} mismatches", threadCount, workload.name,
+                         1000.0 * workload.segments.size() / time, workload.singleThreadTime / time, mismatchCount);
+        }
+    }
+}
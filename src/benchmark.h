@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+
+struct Face;
+struct Triangle;
+struct BoundingBox;
+class Level;
+class GameObject;
+
+// Compares build time and segment query throughput of the level
+// acceleration structures, on the given faces and on synthetic levels.
+void benchmarkCollisionBackends(const std::vector<Face> &faces);
+
+// Compares the scalar Moller-Trumbore test with the block kernels used by
+// PackedTriangles in both layouts, checking that they agree.
+void benchmarkTriangleKernels(const std::vector<Triangle> &triangles);
+
+// Compares closest point queries on the octree with testing every triangle,
+// checking that they agree, on the given faces and on synthetic levels.
+void benchmarkClosestPoints(const std::vector<Face> &faces);
+
+// Compares distance field lookups with closest point queries at a few voxel
+// sizes, reporting build time, memory and interpolation error within the band.
+void benchmarkDistanceField(const std::vector<Face> &faces, float bandWidth);
+
+// Compares updating the octree in place with building it again, removing
+// and adding back a few nearby faces at a time, checking that they agree.
+void benchmarkOctreeUpdates(const std::vector<Face> &faces);
+
+// Compares testing every bullet against every object with querying a loose
+// octree of the objects, as they move around the given bounds.
+void benchmarkLooseOctree(const BoundingBox &bounds);
+
+// Builds the navigation graph of the level and compares path queries that
+// each start a new search with foes chasing a few moving targets, which
+// share cached searches.
+void benchmarkPathQueries(const Level &level, float clearance, float minCellSize);
+
+// Runs segment queries against the level and an object from more and more
+// threads at once, reporting the throughput and checking that every thread
+// count finds the same hits as a single thread.
+void benchmarkConcurrentQueries(const Level &level, const GameObject &object);
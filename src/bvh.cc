@@ -0,0 +1,242 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+
+namespace {
+
+constexpr auto BinCount = 16;
+constexpr auto MaxTrianglesPerLeaf = 16;
+constexpr auto MaxDepth = 64;
+
+// relative costs of a traversal step and of testing a block of triangles
+constexpr auto TraversalCost = 1.0f;
+constexpr auto IntersectionCost = 1.0f;
+
+// leaves are tested a whole block at a time
+uint32_t blockCount(uint32_t triangleCount)
+{
+    return (triangleCount + TriangleBlock::Size - 1) / TriangleBlock::Size;
+}
+
+float surfaceArea(const BoundingBox &box)
+{
+    const auto d = box.max - box.min;
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+} // namespace
+
+struct BVH::BuildTriangle {
+    Triangle triangle;
+    BoundingBox boundingBox;
+    glm::vec3 centroid;
+};
+
+BVH::BVH() = default;
+BVH::~BVH() = default;
+
+void BVH::initialize(const std::vector<Triangle> &triangles)
+{
+    m_nodes.clear();
+    m_triangles.clear();
+
+    if (triangles.empty())
+        return;
+
+    std::vector<BuildTriangle> buildTriangles;
+    buildTriangles.reserve(triangles.size());
+    std::transform(triangles.begin(), triangles.end(), std::back_inserter(buildTriangles), [](const Triangle &triangle) {
+        const auto box = BoundingBox {} | triangle.v0 | triangle.v1 | triangle.v2;
+        return BuildTriangle { triangle, box, 0.5f * (box.min + box.max) };
+    });
+
+    m_nodes.reserve(2 * triangles.size() / MaxTrianglesPerLeaf + 1);
+    build(buildTriangles, 0, buildTriangles.size(), 0);
+
+    // leaves are in the order of their triangles, they only need padding
+    for (auto &node : m_nodes) {
+        if (!node.isLeaf())
+            continue;
+        const auto begin = buildTriangles.begin() + node.first;
+        node.first = m_triangles.size();
+        std::for_each(begin, begin + node.triangleCount, [this](const BuildTriangle &buildTriangle) {
+            m_triangles.append(buildTriangle.triangle);
+        });
+        m_triangles.alignToBlock();
+    }
+}
+
+uint32_t BVH::build(std::vector<BuildTriangle> &buildTriangles, uint32_t begin, uint32_t end, int depth)
+{
+    const auto nodeIndex = static_cast<uint32_t>(m_nodes.size());
+    m_nodes.emplace_back();
+
+    BoundingBox box, centroidBox;
+    for (auto i = begin; i < end; ++i) {
+        box |= buildTriangles[i].boundingBox;
+        centroidBox |= buildTriangles[i].centroid;
+    }
+    m_nodes[nodeIndex].boundingBox = box;
+
+    const auto count = end - begin;
+    const auto makeLeaf = [this, nodeIndex, begin, count] {
+        auto &node = m_nodes[nodeIndex];
+        node.first = begin;
+        node.triangleCount = count;
+        node.axis = 0;
+        return nodeIndex;
+    };
+
+    if (count <= 2 || depth == MaxDepth - 1)
+        return makeLeaf();
+
+    // find the cheapest split plane over all axes using binned centroids
+    struct Bin {
+        BoundingBox boundingBox;
+        uint32_t count = 0;
+    };
+    const auto centroidExtent = centroidBox.max - centroidBox.min;
+    const auto binIndex = [&centroidBox, &centroidExtent](const glm::vec3 &centroid, int axis) {
+        const auto f = (centroid[axis] - centroidBox.min[axis]) / centroidExtent[axis];
+        return std::min(static_cast<int>(f * BinCount), BinCount - 1);
+    };
+
+    auto bestCost = std::numeric_limits<float>::max();
+    auto bestAxis = -1;
+    auto bestSplit = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (centroidExtent[axis] <= 0.0f)
+            continue;
+
+        std::array<Bin, BinCount> bins;
+        for (auto i = begin; i < end; ++i) {
+            auto &bin = bins[binIndex(buildTriangles[i].centroid, axis)];
+            bin.boundingBox |= buildTriangles[i].boundingBox;
+            ++bin.count;
+        }
+
+        // sweep from the right to get the area/count to the right of each plane
+        std::array<float, BinCount - 1> rightCost;
+        BoundingBox rightBox;
+        uint32_t rightCount = 0;
+        for (int i = BinCount - 1; i > 0; --i) {
+            rightBox |= bins[i].boundingBox;
+            rightCount += bins[i].count;
+            rightCost[i - 1] = rightCount ? blockCount(rightCount) * surfaceArea(rightBox) : 0.0f;
+        }
+
+        BoundingBox leftBox;
+        uint32_t leftCount = 0;
+        for (int i = 0; i < BinCount - 1; ++i) {
+            leftBox |= bins[i].boundingBox;
+            leftCount += bins[i].count;
+            if (leftCount == 0 || leftCount == count)
+                continue;
+            const auto cost = blockCount(leftCount) * surfaceArea(leftBox) + rightCost[i];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i;
+            }
+        }
+    }
+
+    if (bestAxis == -1) {
+        // all centroids coincide, nothing to split on
+        return makeLeaf();
+    }
+
+    const auto splitCost = TraversalCost + IntersectionCost * bestCost / surfaceArea(box);
+    const auto leafCost = IntersectionCost * blockCount(count);
+    if (splitCost >= leafCost && count <= MaxTrianglesPerLeaf)
+        return makeLeaf();
+
+    const auto middle = std::partition(buildTriangles.begin() + begin, buildTriangles.begin() + end, [&](const BuildTriangle &buildTriangle) {
+        return binIndex(buildTriangle.centroid, bestAxis) <= bestSplit;
+    });
+    const auto mid = static_cast<uint32_t>(std::distance(buildTriangles.begin(), middle));
+    assert(mid > begin && mid < end);
+
+    build(buildTriangles, begin, mid, depth + 1);
+    const auto second = build(buildTriangles, mid, end, depth + 1);
+
+    auto &node = m_nodes[nodeIndex];
+    node.first = second;
+    node.triangleCount = 0;
+    node.axis = bestAxis;
+    return nodeIndex;
+}
+
+std::optional<float> BVH::intersection(const LineSegment &segment) const
+{
+    return intersection(segment, false);
+}
+
+std::optional<float> BVH::intersection(const LineSegment &segment, bool anyHit) const
+{
+    if (m_nodes.empty())
+        return {};
+
+    RayQuery ray(segment);
+    std::optional<float> collisionT;
+
+    std::array<uint32_t, MaxDepth + 1> stack;
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        const auto &node = m_nodes[stack[--stackSize]];
+
+        if (!ray.intersects(node.boundingBox))
+            continue;
+
+        if (node.isLeaf()) {
+            // hits are searched in [0, t), and the end of the segment or
+            // the closest hit so far are still valid
+            auto t = std::nextafter(ray.tMax, 2.0f);
+            const auto firstBlock = node.first / TriangleBlock::Size;
+            if (m_triangles.intersection(firstBlock, blockCount(node.triangleCount), ray.ray, t, anyHit)) {
+                collisionT = ray.tMax = t;
+                if (anyHit)
+                    return collisionT;
+            }
+            continue;
+        }
+
+        // push the far child first so that the near one is popped next
+        const auto index = static_cast<uint32_t>(&node - m_nodes.data());
+        const auto left = index + 1;
+        const auto right = node.first;
+        if (ray.octant & (1 << node.axis)) {
+            stack[stackSize++] = left;
+            stack[stackSize++] = right;
+        } else {
+            stack[stackSize++] = right;
+            stack[stackSize++] = left;
+        }
+    }
+
+    return collisionT;
+}
+
+BoundingBox BVH::boundingBox() const
+{
+    if (m_nodes.empty())
+        return {};
+    return m_nodes.front().boundingBox;
+}
+
+std::optional<glm::vec3> BVH::findCollision(const LineSegment &segment) const
+{
+    if (const auto t = intersection(segment))
+        return segment.pointAt(*t);
+    return {};
+}
+
+bool BVH::intersectsAny(const LineSegment &segment) const
+{
+    return intersection(segment, true).has_value();
+}
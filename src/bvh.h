@@ -0,0 +1,50 @@
+#pragma once
+
+#include "geometryutils.h"
+#include "packedtriangles.h"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Bounding volume hierarchy over a static triangle set, built with a binned
+// surface area heuristic. Unlike the Octree it doesn't clip triangles, so
+// each triangle is referenced exactly once. Each leaf's triangles start a
+// new block of PackedTriangles, so a leaf is tested a block at a time.
+class BVH
+{
+public:
+    BVH();
+    ~BVH();
+
+    void initialize(const std::vector<Triangle> &triangles);
+
+    std::optional<float> intersection(const LineSegment &segment) const;
+    std::optional<glm::vec3> findCollision(const LineSegment &segment) const;
+    bool intersectsAny(const LineSegment &segment) const;
+
+    std::size_t nodeCount() const { return m_nodes.size(); }
+    // empty if there are no triangles
+    BoundingBox boundingBox() const;
+    // see TriangleLayout
+    void setTriangleLayout(TriangleLayout layout) { m_triangles.setLayout(layout); }
+
+private:
+    struct BuildTriangle;
+    uint32_t build(std::vector<BuildTriangle> &buildTriangles, uint32_t begin, uint32_t end, int depth);
+    std::optional<float> intersection(const LineSegment &segment, bool anyHit) const;
+
+    // Nodes are laid out depth-first: the first child of an internal node
+    // immediately follows it, `first` is the index of the second one.
+    struct Node {
+        BoundingBox boundingBox;
+        uint32_t first; // second child (internal) or first triangle, at the start of a block (leaf)
+        uint32_t triangleCount; // 0 for internal nodes
+        uint8_t axis; // split axis, used to order traversal
+        bool isLeaf() const { return triangleCount != 0; }
+    };
+    std::vector<Node> m_nodes;
+    PackedTriangles m_triangles;
+};
@@ -1,19 +1,28 @@
 #pragma once
 
+#include "bvh.h"
 #include "geometryutils.h"
 
 #include <vector>
 
+// Triangles of an entity node, in a BVH so that segments only test the few
+// near them. intersection() can be called from any number of threads at
+// once, but not while it's being initialized.
 class CollisionMesh
 {
 public:
     CollisionMesh();
     CollisionMesh(const std::vector<Triangle> &triangles);
 
-    void addTriangles(const std::vector<Triangle> &triangles);
+    // Builds the hierarchy over the triangles, replacing any there were.
+    // Meshes are built once, from all their triangles at a time.
+    void initialize(const std::vector<Triangle> &triangles);
+    // see TriangleLayout; Edges by default
+    void setTriangleLayout(TriangleLayout layout) { m_bvh.setTriangleLayout(layout); }
     std::optional<float> intersection(const LineSegment &segment) const;
+    const BoundingBox &boundingBox() const { return m_boundingBox; }
 
 private:
     BoundingBox m_boundingBox;
-    std::vector<Triangle> m_triangles;
+    BVH m_bvh;
 };
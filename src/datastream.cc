@@ -33,6 +33,12 @@ DataStream::DataStream(const char *path)
 {
 }
 
+DataStream::~DataStream()
+{
+    if (m_in)
+        fclose(m_in);
+}
+
 size_t DataStream::readBytes(char *buf, std::size_t size)
 {
     if (m_error)
@@ -43,6 +49,34 @@ size_t DataStream::readBytes(char *buf, std::size_t size)
     return readResult;
 }
 
+long DataStream::position() const
+{
+    return m_in ? ftell(m_in) : -1;
+}
+
+bool DataStream::atEnd() const
+{
+    if (m_error)
+        return true;
+    const auto c = fgetc(m_in);
+    if (c == EOF)
+        return true;
+    ungetc(c, m_in);
+    return false;
+}
+
+long DataStream::bytesLeft() const
+{
+    if (m_error)
+        return 0;
+    const auto position = ftell(m_in);
+    if (position < 0 || fseek(m_in, 0, SEEK_END) != 0)
+        return 0;
+    const auto end = ftell(m_in);
+    fseek(m_in, position, SEEK_SET);
+    return end - position;
+}
+
 DataStream &DataStream::operator>>(int8_t &value)
 {
     readBytes(reinterpret_cast<char *>(&value), 1);
@@ -66,3 +100,48 @@ DataStream &DataStream::operator>>(int32_t &value)
     }
     return *this;
 }
+
+DataWriter::DataWriter(const char *path)
+    : m_out(fopen(path, "wb"))
+    , m_error(m_out == nullptr)
+    , m_needSwap(needSwap())
+{
+}
+
+DataWriter::~DataWriter()
+{
+    if (m_out)
+        fclose(m_out);
+}
+
+size_t DataWriter::writeBytes(const char *buf, std::size_t size)
+{
+    if (m_error)
+        return 0;
+    const auto writeResult = fwrite(buf, 1, size, m_out);
+    if (writeResult != size)
+        m_error = true;
+    return writeResult;
+}
+
+DataWriter &DataWriter::operator<<(int8_t value)
+{
+    writeBytes(reinterpret_cast<const char *>(&value), 1);
+    return *this;
+}
+
+DataWriter &DataWriter::operator<<(int16_t value)
+{
+    if (m_needSwap)
+        value = byteSwap16(value);
+    writeBytes(reinterpret_cast<const char *>(&value), 2);
+    return *this;
+}
+
+DataWriter &DataWriter::operator<<(int32_t value)
+{
+    if (m_needSwap)
+        value = byteSwap32(value);
+    writeBytes(reinterpret_cast<const char *>(&value), 4);
+    return *this;
+}
@@ -1,17 +1,26 @@
 #pragma once
 
+#include "noncopyable.h"
+
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <vector>
 
 #include <glm/glm.hpp>
 
-class DataStream
+class DataStream : private NonCopyable
 {
 public:
     explicit DataStream(const char *path);
+    ~DataStream();
 
     size_t readBytes(char *buf, std::size_t size);
+    long position() const;
+    bool atEnd() const;
+    // Bytes between the position and the end, to check counts read from the
+    // stream before allocating for them.
+    long bytesLeft() const;
 
     DataStream &operator>>(char &value);
     DataStream &operator>>(int8_t &value);
@@ -30,6 +39,30 @@ private:
     bool m_needSwap;
 };
 
+class DataWriter : private NonCopyable
+{
+public:
+    explicit DataWriter(const char *path);
+    ~DataWriter();
+
+    size_t writeBytes(const char *buf, std::size_t size);
+
+    DataWriter &operator<<(int8_t value);
+    DataWriter &operator<<(uint8_t value);
+    DataWriter &operator<<(int16_t value);
+    DataWriter &operator<<(uint16_t value);
+    DataWriter &operator<<(int32_t value);
+    DataWriter &operator<<(uint32_t value);
+    DataWriter &operator<<(float value);
+
+    operator bool() const { return !m_error; }
+
+private:
+    FILE *m_out;
+    bool m_error;
+    bool m_needSwap;
+};
+
 inline DataStream &DataStream::operator>>(char &value)
 {
     return *this >> reinterpret_cast<int8_t &>(value);
@@ -55,6 +88,29 @@ inline DataStream &DataStream::operator>>(float &value)
     return *this >> reinterpret_cast<int32_t &>(value);
 }
 
+inline DataWriter &DataWriter::operator<<(uint8_t value)
+{
+    return *this << static_cast<int8_t>(value);
+}
+
+inline DataWriter &DataWriter::operator<<(uint16_t value)
+{
+    return *this << static_cast<int16_t>(value);
+}
+
+inline DataWriter &DataWriter::operator<<(uint32_t value)
+{
+    return *this << static_cast<int32_t>(value);
+}
+
+inline DataWriter &DataWriter::operator<<(float value)
+{
+    int32_t bits;
+    static_assert(sizeof(bits) == sizeof(value));
+    std::memcpy(&bits, &value, sizeof(bits));
+    return *this << bits;
+}
+
 namespace detail {
 
 template<typename SizeT, typename Container>
@@ -88,6 +144,15 @@ DataStream &operator>>(DataStream &ds, std::vector<T> &v)
     return detail::readContainer<uint32_t>(ds, v);
 }
 
+template<typename T>
+DataWriter &operator<<(DataWriter &dw, const std::vector<T> &v)
+{
+    dw << static_cast<uint32_t>(v.size());
+    for (const auto &t : v)
+        dw << t;
+    return dw;
+}
+
 template<typename T>
 DataStream &operator>>(DataStream &ds, std::basic_string<T> &s)
 {
@@ -130,3 +195,15 @@ DataStream &operator>>(DataStream &ds, glm::qua<T, Q> &q)
     ds >> q.w;
     return ds;
 }
+
+template<typename T, glm::qualifier Q>
+DataWriter &operator<<(DataWriter &dw, const glm::vec<2, T, Q> &v)
+{
+    return dw << v.x << v.y;
+}
+
+template<typename T, glm::qualifier Q>
+DataWriter &operator<<(DataWriter &dw, const glm::vec<3, T, Q> &v)
+{
+    return dw << v.x << v.y << v.z;
+}
@@ -0,0 +1,232 @@
+#include "distancefield.h"
+
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <limits>
+#include <thread>
+
+namespace {
+constexpr auto MaxSample = 0xffff;
+constexpr auto BrickKeyBits = 21;
+constexpr auto BrickKeyMask = (uint64_t(1) << BrickKeyBits) - 1;
+}
+
+void DistanceField::initialize(const std::vector<Triangle> &triangles, float voxelSize, float bandWidth)
+{
+    // the distance to a triangle is at least the distance to its box and to
+    // its plane, which are much cheaper to find
+    std::vector<BoundingBox> triangleBoxes;
+    std::vector<glm::vec4> trianglePlanes;
+    triangleBoxes.reserve(triangles.size());
+    trianglePlanes.reserve(triangles.size());
+    BoundingBox box;
+    for (const auto &triangle : triangles) {
+        triangleBoxes.push_back(BoundingBox() | triangle.v0 | triangle.v1 | triangle.v2);
+        box |= triangleBoxes.back();
+        const auto normal = glm::cross(triangle.v1 - triangle.v0, triangle.v2 - triangle.v0);
+        const auto length = glm::length(normal);
+        const auto unitNormal = length > 0.0f ? normal / length : glm::vec3(0);
+        trianglePlanes.emplace_back(unitNormal, -glm::dot(unitNormal, triangle.v0));
+    }
+
+    m_voxelSize = voxelSize;
+    m_bandWidth = bandWidth;
+    m_bricks.clear();
+    m_samples.clear();
+    if (triangles.empty()) {
+        m_brickGridSize = glm::ivec3(0);
+        return;
+    }
+
+    // pad the grid by the band so that it covers every point closer than that
+    const auto brickWidth = BrickSize * voxelSize;
+    const auto size = box.max - box.min + glm::vec3(2.0f * bandWidth);
+    m_origin = box.min - glm::vec3(bandWidth);
+    m_brickGridSize = glm::clamp(glm::ivec3(glm::ceil(size / brickWidth)), glm::ivec3(1), glm::ivec3(1 << BrickKeyBits));
+
+    // Bins each triangle in the bricks its box overlaps once grown by the
+    // band: those are the only bricks where it can be the closest triangle,
+    // and the only ones that get stored.
+    std::unordered_map<uint64_t, std::vector<uint32_t>> brickTriangles;
+    for (std::size_t i = 0; i < triangles.size(); ++i) {
+        const auto &triangleBox = triangleBoxes[i];
+        const auto first = glm::clamp(glm::ivec3(glm::floor((triangleBox.min - glm::vec3(bandWidth) - m_origin) / brickWidth)), glm::ivec3(0), m_brickGridSize - 1);
+        const auto last = glm::clamp(glm::ivec3(glm::floor((triangleBox.max + glm::vec3(bandWidth) - m_origin) / brickWidth)), glm::ivec3(0), m_brickGridSize - 1);
+        for (int z = first.z; z <= last.z; ++z) {
+            for (int y = first.y; y <= last.y; ++y) {
+                for (int x = first.x; x <= last.x; ++x)
+                    brickTriangles[brickKey({ x, y, z })].push_back(i);
+            }
+        }
+    }
+    // in key order, so that the samples of neighbouring bricks end up close
+    std::vector<uint64_t> brickKeys;
+    brickKeys.reserve(brickTriangles.size());
+    for (const auto &brick : brickTriangles)
+        brickKeys.push_back(brick.first);
+    std::sort(brickKeys.begin(), brickKeys.end());
+
+    // Bricks are sampled in blocks of a few cells, each testing the
+    // candidates of the brick that can be the closest to one of its samples.
+    // Bricks where no sample ends up within the band are dropped.
+    constexpr auto BlockSize = 4;
+    constexpr auto BlocksPerSide = BrickSize / BlockSize;
+    constexpr auto BlockCount = BlocksPerSide * BlocksPerSide * BlocksPerSide;
+    const auto blockRadius = 0.5f * std::sqrt(3.0f) * BlockSize * voxelSize;
+    std::vector<std::vector<uint16_t>> brickSamples(brickKeys.size());
+    const auto threadCount = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::future<void>> tasks;
+    for (unsigned thread = 0; thread < threadCount; ++thread) {
+        tasks.push_back(std::async(std::launch::async, [this, &triangles, &triangleBoxes, &trianglePlanes, &brickTriangles, &brickKeys, &brickSamples, brickWidth, blockRadius, thread, threadCount] {
+            std::vector<std::pair<float, uint32_t>> nearCandidates;
+            for (auto i = static_cast<std::size_t>(thread); i < brickKeys.size(); i += threadCount) {
+                const auto key = brickKeys[i];
+                const auto &candidates = brickTriangles.find(key)->second;
+                const auto brick = glm::ivec3(key & BrickKeyMask, (key >> BrickKeyBits) & BrickKeyMask, key >> (2 * BrickKeyBits));
+                const auto brickOrigin = m_origin + glm::vec3(brick) * brickWidth;
+
+                auto &samples = brickSamples[i];
+                samples.resize(BrickSampleCount);
+                for (int block = 0; block < BlockCount; ++block) {
+                    // A triangle further from the center of the block than
+                    // the nearest one plus the block diameter isn't the
+                    // closest to any of its samples. The others are tested
+                    // nearest first, so that the box test rejects most of
+                    // them once a close triangle is found.
+                    const auto blockFirst = glm::ivec3(block % BlocksPerSide, (block / BlocksPerSide) % BlocksPerSide, block / (BlocksPerSide * BlocksPerSide)) * BlockSize;
+                    const auto blockCenter = brickOrigin + (glm::vec3(blockFirst) + glm::vec3(0.5f * BlockSize)) * m_voxelSize;
+                    nearCandidates.clear();
+                    auto nearestDistance = std::numeric_limits<float>::max();
+                    for (const auto triangle : candidates) {
+                        const auto distance = glm::length(triangles[triangle].closestPoint(blockCenter) - blockCenter);
+                        if (distance <= m_bandWidth + blockRadius) {
+                            nearCandidates.emplace_back(distance, triangle);
+                            nearestDistance = std::min(nearestDistance, distance);
+                        }
+                    }
+                    std::sort(nearCandidates.begin(), nearCandidates.end());
+                    const auto nearEnd = std::partition_point(nearCandidates.begin(), nearCandidates.end(), [maxDistance = nearestDistance + 2.0f * blockRadius](const auto &candidate) {
+                        return candidate.first <= maxDistance;
+                    });
+
+                    // the last blocks along each axis also compute the samples
+                    // on the far side of the brick
+                    auto blockLast = blockFirst + BlockSize;
+                    for (int axis = 0; axis < 3; ++axis) {
+                        if (blockLast[axis] == BrickSize)
+                            blockLast[axis] = BrickSamples;
+                    }
+                    for (int z = blockFirst.z; z < blockLast.z; ++z) {
+                        for (int y = blockFirst.y; y < blockLast.y; ++y) {
+                            for (int x = blockFirst.x; x < blockLast.x; ++x) {
+                                const auto point = brickOrigin + glm::vec3(x, y, z) * m_voxelSize;
+                                auto distance2 = m_bandWidth * m_bandWidth;
+                                for (auto candidate = nearCandidates.begin(); candidate != nearEnd; ++candidate) {
+                                    const auto &plane = trianglePlanes[candidate->second];
+                                    const auto planeDistance = glm::dot(glm::vec3(plane), point) + plane.w;
+                                    if (planeDistance * planeDistance >= distance2)
+                                        continue;
+                                    const auto &triangleBox = triangleBoxes[candidate->second];
+                                    const auto boxOffset = glm::clamp(point, triangleBox.min, triangleBox.max) - point;
+                                    if (glm::dot(boxOffset, boxOffset) >= distance2)
+                                        continue;
+                                    const auto offset = triangles[candidate->second].closestPoint(point) - point;
+                                    distance2 = std::min(distance2, glm::dot(offset, offset));
+                                }
+                                samples[(z * BrickSamples + y) * BrickSamples + x] = static_cast<uint16_t>(std::lround(std::sqrt(distance2) / m_bandWidth * MaxSample));
+                            }
+                        }
+                    }
+                }
+                if (std::all_of(samples.begin(), samples.end(), [](uint16_t sample) { return sample == MaxSample; }))
+                    samples.clear();
+            }
+        }));
+    }
+    for (auto &task : tasks)
+        task.get();
+
+    for (std::size_t i = 0; i < brickSamples.size(); ++i) {
+        if (brickSamples[i].empty())
+            continue;
+        m_bricks.emplace(brickKeys[i], m_samples.size());
+        m_samples.insert(m_samples.end(), brickSamples[i].begin(), brickSamples[i].end());
+    }
+}
+
+uint64_t DistanceField::brickKey(const glm::ivec3 &brick)
+{
+    return (static_cast<uint64_t>(brick.z) << (2 * BrickKeyBits)) | (static_cast<uint64_t>(brick.y) << BrickKeyBits) | static_cast<uint64_t>(brick.x);
+}
+
+std::size_t DistanceField::memoryUsage() const
+{
+    // roughly, for the brick index: a bucket pointer each, and a node with
+    // the key, the offset and a next pointer per brick
+    const auto brickIndexUsage = m_bricks.bucket_count() * sizeof(void *) + m_bricks.size() * (sizeof(void *) + sizeof(uint64_t) + sizeof(uint64_t));
+    return brickIndexUsage + m_samples.size() * sizeof(uint16_t);
+}
+
+float DistanceField::distance(const glm::vec3 &point) const
+{
+    return sample(point, nullptr);
+}
+
+glm::vec3 DistanceField::gradient(const glm::vec3 &point) const
+{
+    glm::vec3 result;
+    sample(point, &result);
+    return result;
+}
+
+float DistanceField::sample(const glm::vec3 &point, glm::vec3 *gradient) const
+{
+    if (gradient)
+        *gradient = glm::vec3(0);
+
+    const auto position = (point - m_origin) / m_voxelSize;
+    const auto cellPosition = glm::floor(position);
+    const auto cell = glm::ivec3(cellPosition);
+    if (cell.x < 0 || cell.y < 0 || cell.z < 0)
+        return m_bandWidth;
+    const auto brick = cell / BrickSize;
+    if (brick.x >= m_brickGridSize.x || brick.y >= m_brickGridSize.y || brick.z >= m_brickGridSize.z)
+        return m_bandWidth;
+    const auto it = m_bricks.find(brickKey(brick));
+    if (it == m_bricks.end())
+        return m_bandWidth;
+    const auto first = it->second;
+
+    // corners of the cell, interpolated along x, then y, then z
+    constexpr auto StrideY = BrickSamples;
+    constexpr auto StrideZ = BrickSamples * BrickSamples;
+    const auto local = cell - brick * BrickSize;
+    const auto *corners = &m_samples[first + (local.z * BrickSamples + local.y) * BrickSamples + local.x];
+    const float c000 = corners[0];
+    const float c100 = corners[1];
+    const float c010 = corners[StrideY];
+    const float c110 = corners[StrideY + 1];
+    const float c001 = corners[StrideZ];
+    const float c101 = corners[StrideZ + 1];
+    const float c011 = corners[StrideZ + StrideY];
+    const float c111 = corners[StrideZ + StrideY + 1];
+
+    const auto t = position - cellPosition;
+    const auto c00 = glm::mix(c000, c100, t.x);
+    const auto c10 = glm::mix(c010, c110, t.x);
+    const auto c01 = glm::mix(c001, c101, t.x);
+    const auto c11 = glm::mix(c011, c111, t.x);
+    const auto c0 = glm::mix(c00, c10, t.y);
+    const auto c1 = glm::mix(c01, c11, t.y);
+    const auto scale = m_bandWidth / MaxSample;
+
+    if (gradient) {
+        const auto dx = glm::mix(glm::mix(c100 - c000, c110 - c010, t.y), glm::mix(c101 - c001, c111 - c011, t.y), t.z);
+        const auto dy = glm::mix(c10 - c00, c11 - c01, t.z);
+        const auto dz = c1 - c0;
+        *gradient = glm::vec3(dx, dy, dz) * (scale / m_voxelSize);
+    }
+
+    return glm::mix(c0, c1, t.z) * scale;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "geometryutils.h"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Distance to the closest level geometry, sampled on a regular grid and
+// interpolated trilinearly. The grid is split into bricks of cells and only
+// the bricks within bandWidth of some geometry are stored, looked up by their
+// position, so empty space costs nothing; further away distance() just
+// returns bandWidth. Level geometry isn't closed, walls are
+// often single sided, so the distances are unsigned.
+class DistanceField
+{
+public:
+    // Samples the distance to the triangles, split between threads by bricks.
+    void initialize(const std::vector<Triangle> &triangles, float voxelSize, float bandWidth);
+
+    float bandWidth() const { return m_bandWidth; }
+    std::size_t brickCount() const { return m_bricks.size(); }
+    std::size_t memoryUsage() const;
+
+    // Interpolated distance, at most bandWidth.
+    float distance(const glm::vec3 &point) const;
+    // Gradient of the interpolated distance, pointing away from the geometry.
+    // Its length is about 1 near geometry and 0 beyond the band.
+    glm::vec3 gradient(const glm::vec3 &point) const;
+
+private:
+    static constexpr int BrickSize = 8; // cells along each side
+    static constexpr int BrickSamples = BrickSize + 1; // bricks share their boundary samples
+    static constexpr int BrickSampleCount = BrickSamples * BrickSamples * BrickSamples;
+    static uint64_t brickKey(const glm::ivec3 &brick);
+    float sample(const glm::vec3 &point, glm::vec3 *gradient) const;
+
+    glm::vec3 m_origin = glm::vec3(0);
+    float m_voxelSize = 1.0f;
+    float m_bandWidth = 0.0f;
+    glm::ivec3 m_brickGridSize = glm::ivec3(0);
+    std::unordered_map<uint64_t, uint32_t> m_bricks; // first sample of the stored bricks, by key
+    std::vector<uint16_t> m_samples; // distances scaled from [0, bandWidth]
+};
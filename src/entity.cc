@@ -159,14 +159,17 @@ bool Entity::load(DataStream &ds)
             ds >> meshCount;
             node->meshes.reserve(meshCount);
 
+            // the collision mesh is built once for all the meshes
+            std::vector<Triangle> collisionTriangles;
             for (int i = 0; i < meshCount; ++i) {
                 MaterialKey materialKey;
                 ds >> materialKey;
                 auto [triangles, mesh] = readMesh(ds);
                 const auto *material = cachedMaterial(materialKey);
                 node->meshes.push_back({ std::move(mesh), material });
-                node->collisionMesh.addTriangles(triangles);
+                collisionTriangles.insert(collisionTriangles.end(), triangles.begin(), triangles.end());
             }
+            node->collisionMesh.initialize(collisionTriangles);
         }
     }
 
@@ -201,6 +204,15 @@ std::optional<glm::vec3> Entity::findCollision(const LineSegment &segment, const
     return segment.pointAt(*collisionT);
 }
 
+float Entity::boundingRadius(float frame) const
+{
+    float radius = 0.0f;
+    for (const auto *node : m_rootNodes) {
+        radius = std::max(radius, node->boundingRadius(glm::mat4(1), frame));
+    }
+    return radius;
+}
+
 bool Entity::setActiveAction(std::string_view nodeName, std::string_view actionName)
 {
     auto nodeIt = std::find_if(m_nodes.begin(), m_nodes.end(), [&nodeName](auto &node) {
@@ -279,6 +291,24 @@ std::optional<float> Entity::Node::intersection(const LineSegment &segment, cons
     return collisionMesh.intersection(localLineSegment);
 }
 
+float Entity::Node::boundingRadius(const glm::mat4 &parentWorldMatrix, float frame) const
+{
+    const auto worldMatrix = worldMatrixAt(parentWorldMatrix, frame);
+    float radius = 0.0f;
+    const auto &box = collisionMesh.boundingBox();
+    if (box.min.x <= box.max.x) {
+        for (int i = 0; i < 8; ++i) {
+            const auto corner = glm::vec3((i & 1) ? box.max.x : box.min.x, (i & 2) ? box.max.y : box.min.y, (i & 4) ? box.max.z : box.min.z);
+            const auto p = worldMatrix * glm::vec4(corner, 1.0f);
+            radius = std::max(radius, glm::length(glm::vec3(p) / p.w));
+        }
+    }
+    for (const auto *child : children) {
+        radius = std::max(radius, child->boundingRadius(worldMatrix, frame));
+    }
+    return radius;
+}
+
 void Entity::Node::dump(int indent) const
 {
     spdlog::info("{:>{}} {}: {} meshes, {} actions", "", indent, name, meshes.size(), actions.size());
@@ -25,6 +25,9 @@ struct Action {
     std::optional<Channel<glm::vec3>> scaleChannel;
 };
 
+// The const members only read the entity, so they can be called from any
+// number of threads at once; load and setActiveAction can't run alongside
+// them.
 class Entity
 {
 public:
@@ -33,6 +36,9 @@ public:
     bool load(const char *filepath);
     void render(Renderer *renderer, const glm::mat4 &worldMatrix, float frame) const;
     std::optional<glm::vec3> findCollision(const LineSegment &segment, const glm::mat4 &worldMatrix, float frame) const;
+    // Radius of the sphere around the entity origin that contains all of its
+    // collision geometry at the given frame.
+    float boundingRadius(float frame) const;
 
     bool setActiveAction(std::string_view node, std::string_view action);
 
@@ -43,6 +49,7 @@ private:
         ~Node();
         void render(Renderer *renderer, const glm::mat4 &parentWorldMatrix, float frame) const;
         std::optional<float> intersection(const LineSegment &segment, const glm::mat4 &parentWorldMatrix, float frame) const;
+        float boundingRadius(const glm::mat4 &parentWorldMatrix, float frame) const;
         glm::mat4 worldMatrixAt(const glm::mat4 &parentWorldMatrix, float frame) const;
         void dump(int indent) const;
 
@@ -1,14 +1,78 @@
 #include "foe.h"
 
+#include "level.h"
+#include "player.h"
+#include "world.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+
 constexpr auto FoeEntityPath = "assets/meshes/player-ship.w3d";
 
 Foe::Foe(World *world)
     : GameObject(world, FoeEntityPath)
 {
+    // same ship as the player's
+    setCollisionCapsule({ glm::vec3(0, 0, -2), glm::vec3(0, 0, 2), 1.0f });
 }
 
 Foe::~Foe() = default;
 
-void Foe::update(float)
+void Foe::update(float elapsed)
+{
+    constexpr auto Speed = 4.0f;
+    constexpr auto AngularVelocity = 1.5f;
+    // Paths are planned again this often to follow the player. Foes chasing
+    // the same player share the planner's search, so this stays cheap.
+    constexpr auto RepathInterval = 0.5f;
+    // how close to a waypoint counts as reaching it
+    constexpr auto WaypointRadius = 1.0f;
+    // foes hold off at this distance from the player
+    constexpr auto ChaseDistance = 8.0f;
+
+    const auto target = m_world->player()->position();
+
+    m_repathDelay -= elapsed;
+    if (m_repathDelay <= 0.0f) {
+        m_repathDelay = RepathInterval;
+        // the first waypoint is the foe's own position
+        m_nextWaypoint = 1;
+        if (!m_world->findPath(position(), target, m_path))
+            m_path.clear();
+    }
+
+    while (m_nextWaypoint < m_path.size() && glm::length(m_path[m_nextWaypoint] - position()) < WaypointRadius)
+        ++m_nextWaypoint;
+    if (m_nextWaypoint >= m_path.size() || glm::length(target - position()) < ChaseDistance)
+        return;
+
+    // Veers away from the geometry closer than the distance field's band,
+    // more so the closer it is, rather than scraping along it. The path
+    // already keeps clear of it, this is for the corners it cuts.
+    const auto *level = m_world->level();
+    auto heading = glm::normalize(m_path[m_nextWaypoint] - position());
+    const auto bandWidth = level->distanceBandWidth();
+    if (const auto distance = level->distance(position()); distance < bandWidth)
+        heading = glm::normalize(heading + (1.0f - distance / bandWidth) * level->gradient(position()));
+
+    turnTowards(heading, elapsed * AngularVelocity);
+    move(direction() * elapsed * Speed);
+}
+
+void Foe::turnTowards(const glm::vec3 &direction, float maxAngle)
 {
+    const auto current = this->direction();
+    const auto axis = glm::cross(current, direction);
+    const auto axisLength = glm::length(axis);
+    const auto angle = std::atan2(axisLength, glm::dot(current, direction));
+    if (axisLength < 1e-6f) {
+        // straight ahead, or straight behind: any axis across will do
+        if (angle < 1.0f)
+            return;
+        setRotation(glm::mat3(glm::rotate(glm::mat4(1), std::min(angle, maxAngle), rotation()[1])) * rotation());
+        return;
+    }
+    setRotation(glm::mat3(glm::rotate(glm::mat4(1), std::min(angle, maxAngle), axis / axisLength)) * rotation());
 }
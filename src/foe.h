@@ -1,5 +1,7 @@
 #include "gameobject.h"
 
+#include <vector>
+
 class Foe : public GameObject
 {
 public:
@@ -7,4 +9,11 @@ public:
     ~Foe() override;
 
     void update(float elapsed) override;
+
+private:
+    void turnTowards(const glm::vec3 &direction, float maxAngle);
+
+    std::vector<glm::vec3> m_path; // to the player, see World::findPath
+    std::size_t m_nextWaypoint = 0;
+    float m_repathDelay = 0.0f;
 };
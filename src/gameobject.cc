@@ -1,8 +1,11 @@
 #include "gameobject.h"
 
 #include "entity.h"
+#include "level.h"
 #include "world.h"
 
+#include <algorithm>
+
 GameObject::GameObject(World *world, const char *entityPath)
     : m_world(world)
     , m_entity(new Entity)
@@ -10,6 +13,7 @@ GameObject::GameObject(World *world, const char *entityPath)
     , m_rotation(glm::mat3(1))
 {
     m_entity->load(entityPath);
+    m_boundingRadius = m_entity->boundingRadius(0);
     updateTransformMatrix();
 }
 
@@ -27,6 +31,40 @@ void GameObject::setRotation(const glm::mat3 &rotation)
     updateTransformMatrix();
 }
 
+void GameObject::move(const glm::vec3 &offset)
+{
+    if (!m_collisionCapsule) {
+        setPosition(m_position + offset);
+        return;
+    }
+
+    // Collide and slide: move up to the first contact, then go on with what's
+    // left of the offset projected onto the contact plane. The position is
+    // kept a small distance off the contact, so that the next sweep doesn't
+    // start inside the geometry.
+    constexpr auto MaxIterations = 4;
+    constexpr auto Skin = 1e-3f;
+
+    const auto *level = m_world->level();
+    auto position = m_position;
+    auto motion = offset;
+    for (int i = 0; i < MaxIterations; ++i) {
+        const auto length = glm::length(motion);
+        if (length == 0.0f)
+            break;
+        const Capsule capsule { position + m_rotation * m_collisionCapsule->a, position + m_rotation * m_collisionCapsule->b, m_collisionCapsule->radius };
+        const auto hit = level->sweepCapsule(capsule, motion);
+        if (!hit) {
+            position += motion;
+            break;
+        }
+        position += std::max(hit->t - Skin / length, 0.0f) * motion;
+        motion *= 1.0f - hit->t;
+        motion -= glm::dot(motion, hit->normal) * hit->normal;
+    }
+    setPosition(position);
+}
+
 void GameObject::updateTransformMatrix()
 {
     const auto t = glm::translate(glm::mat4(1), m_position);
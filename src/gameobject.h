@@ -24,8 +24,16 @@ public:
 
     glm::vec3 direction() const { return m_rotation[2]; }
 
+    // Capsule in object space that movement is resolved against the level with.
+    void setCollisionCapsule(const Capsule &capsule) { m_collisionCapsule = capsule; }
+    // Moves by the given offset, sliding along any level geometry in the way.
+    void move(const glm::vec3 &offset);
+
     glm::mat4 transformMatrix() const { return m_transformMatrix; }
 
+    // Radius of the sphere around the position that contains the collision geometry.
+    float boundingRadius() const { return m_boundingRadius; }
+
     void render(Renderer *renderer) const;
 
     std::optional<glm::vec3> findCollision(const LineSegment &segment) const;
@@ -42,4 +50,6 @@ private:
     glm::vec3 m_position;
     glm::mat3 m_rotation;
     glm::mat4 m_transformMatrix;
+    float m_boundingRadius;
+    std::optional<Capsule> m_collisionCapsule;
 };
@@ -3,7 +3,8 @@
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/component_wise.hpp>
 
-#include <tuple>
+#include <algorithm>
+#include <cmath>
 
 glm::vec3 LineSegment::pointAt(float t) const
 {
@@ -25,6 +26,56 @@ Ray LineSegment::ray() const
     return { from, to - from };
 }
 
+glm::vec3 LineSegment::closestPoint(const glm::vec3 &p) const
+{
+    const auto d = to - from;
+    const auto length2 = glm::dot(d, d);
+    if (length2 == 0.0f)
+        return from;
+    return from + std::clamp(glm::dot(p - from, d) / length2, 0.0f, 1.0f) * d;
+}
+
+std::pair<glm::vec3, glm::vec3> LineSegment::closestPoints(const LineSegment &other) const
+{
+    constexpr auto Epsilon = 1e-12f;
+
+    const auto d1 = to - from;
+    const auto d2 = other.to - other.from;
+    const auto r = from - other.from;
+    const auto a = glm::dot(d1, d1);
+    const auto e = glm::dot(d2, d2);
+    const auto f = glm::dot(d2, r);
+
+    if (a <= Epsilon && e <= Epsilon)
+        return { from, other.from };
+
+    float s, t;
+    if (a <= Epsilon) {
+        s = 0.0f;
+        t = std::clamp(f / e, 0.0f, 1.0f);
+    } else {
+        const auto c = glm::dot(d1, r);
+        if (e <= Epsilon) {
+            t = 0.0f;
+            s = std::clamp(-c / a, 0.0f, 1.0f);
+        } else {
+            const auto b = glm::dot(d1, d2);
+            const auto denom = a * e - b * b;
+            s = denom != 0.0f ? std::clamp((b * f - c * e) / denom, 0.0f, 1.0f) : 0.0f;
+            t = (b * s + f) / e;
+            if (t < 0.0f) {
+                t = 0.0f;
+                s = std::clamp(-c / a, 0.0f, 1.0f);
+            } else if (t > 1.0f) {
+                t = 1.0f;
+                s = std::clamp((b - c) / a, 0.0f, 1.0f);
+            }
+        }
+    }
+
+    return { from + s * d1, other.from + t * d2 };
+}
+
 glm::vec3 Ray::pointAt(float t) const
 {
     return origin + t * direction;
@@ -42,7 +93,10 @@ bool Ray::intersects(const BoundingBox &box) const
 
 bool BoundingBox::contains(const glm::vec3 &p) const
 {
-    constexpr auto Epsilon = 1e-6;
+    // relative to the box coordinates, so that vertices created by clipping
+    // on large levels don't fall outside because of rounding
+    const auto scale = std::max(1.0f, glm::compMax(glm::max(glm::abs(min), glm::abs(max))));
+    const auto Epsilon = 1e-6f * scale;
     return p.x > min.x - Epsilon && p.x < max.x + Epsilon &&
             p.y > min.y - Epsilon && p.y < max.y + Epsilon &&
             p.z > min.z - Epsilon && p.z < max.z + Epsilon;
@@ -62,46 +116,76 @@ BoundingBox &BoundingBox::operator|=(const glm::vec3 &p)
     return *this;
 }
 
-static auto intersectionRange(const BoundingBox &box, const Ray &ray)
+BoundingBox BoundingBox::operator|(const BoundingBox &other) const
 {
-    const auto t0 = (box.min - ray.origin) / ray.direction;
-    const auto t1 = (box.max - ray.origin) / ray.direction;
+    BoundingBox b = *this;
+    b |= other;
+    return b;
+}
 
-    const auto tMin = glm::min(t0, t1);
-    const auto tMax = glm::max(t0, t1);
+BoundingBox &BoundingBox::operator|=(const BoundingBox &other)
+{
+    min = glm::min(other.min, min);
+    max = glm::max(other.max, max);
+    return *this;
+}
 
-    const auto tClose = glm::compMax(tMin);
-    const auto tFar = glm::compMin(tMax);
+bool BoundingBox::intersects(const LineSegment &segment) const
+{
+    return RayQuery(segment).intersects(*this);
+}
 
-    return std::tuple(tClose, tFar);
+bool BoundingBox::intersects(const Ray &ray) const
+{
+    return RayQuery(ray).intersects(*this);
 }
 
-bool BoundingBox::intersects(const LineSegment &segment) const
+bool BoundingBox::intersects(const BoundingBox &other) const
 {
-    const auto [tClose, tFar] = intersectionRange(*this, segment.ray());
+    return min.x <= other.max.x && max.x >= other.min.x &&
+            min.y <= other.max.y && max.y >= other.min.y &&
+            min.z <= other.max.z && max.z >= other.min.z;
+}
 
-    if (tClose > tFar)
-        return false;
+namespace {
+glm::vec3 safeInverse(const glm::vec3 &direction)
+{
+    constexpr auto Epsilon = 1e-20f;
+    const auto safe = [Epsilon](float d) {
+        return std::fabs(d) > Epsilon ? d : std::copysign(Epsilon, d);
+    };
+    return 1.0f / glm::vec3(safe(direction.x), safe(direction.y), safe(direction.z));
+}
+} // namespace
 
-    // intersection outside segment?
-    if (tClose > 1.0f || tFar < 0.0f)
-        return false;
+RayQuery::RayQuery(const Ray &ray, float tMax)
+    : ray(ray)
+    , invDirection(safeInverse(ray.direction))
+    , octant((std::signbit(ray.direction.x) ? 1 : 0) | (std::signbit(ray.direction.y) ? 2 : 0) | (std::signbit(ray.direction.z) ? 4 : 0))
+    , tMax(tMax)
+{
+}
 
-    return true;
+RayQuery::RayQuery(const LineSegment &segment)
+    : RayQuery(segment.ray(), 1.0f)
+{
 }
 
-bool BoundingBox::intersects(const Ray &ray) const
+std::pair<float, float> RayQuery::intersectionRange(const BoundingBox &box) const
 {
-    const auto [tClose, tFar] = intersectionRange(*this, ray);
+    const auto t0 = slabT(box.min);
+    const auto t1 = slabT(box.max);
 
-    if (tClose > tFar)
-        return false;
+    const auto tClose = glm::compMax(glm::min(t0, t1));
+    const auto tFar = glm::compMin(glm::max(t0, t1));
 
-    // intersection behind ray origin?
-    if (tFar < 0.0f)
-        return false;
+    return { tClose, tFar };
+}
 
-    return true;
+bool RayQuery::intersects(const BoundingBox &box) const
+{
+    const auto [tClose, tFar] = intersectionRange(box);
+    return tClose <= tFar && tClose <= tMax && tFar >= 0.0f;
 }
 
 std::optional<float> Triangle::intersection(const LineSegment &segment) const
@@ -145,3 +229,308 @@ std::optional<float> Triangle::intersection(const Ray &ray) const
 
     return t;
 }
+
+bool Triangle::intersects(const BoundingBox &box) const
+{
+    // separating axis test (Akenine-Moller): the box axes, the triangle
+    // normal and the cross products of the box axes with the triangle edges
+    const auto center = 0.5f * (box.min + box.max);
+    const auto halfSize = 0.5f * (box.max - box.min);
+    const glm::vec3 v[] = { v0 - center, v1 - center, v2 - center };
+    const glm::vec3 e[] = { v[1] - v[0], v[2] - v[1], v[0] - v[2] };
+
+    const auto separates = [&v, &halfSize](const glm::vec3 &axis) {
+        const auto p0 = glm::dot(v[0], axis);
+        const auto p1 = glm::dot(v[1], axis);
+        const auto p2 = glm::dot(v[2], axis);
+        const auto r = glm::dot(halfSize, glm::abs(axis));
+        return std::min({ p0, p1, p2 }) > r || std::max({ p0, p1, p2 }) < -r;
+    };
+
+    for (int i = 0; i < 3; ++i) {
+        auto axis = glm::vec3(0);
+        axis[i] = 1.0f;
+        if (separates(axis))
+            return false;
+        for (const auto &edge : e) {
+            if (separates(glm::cross(axis, edge)))
+                return false;
+        }
+    }
+    return !separates(glm::cross(e[0], e[1]));
+}
+
+// Ericson, Real-Time Collision Detection, 5.1.5
+glm::vec3 Triangle::closestPoint(const glm::vec3 &p) const
+{
+    const auto ab = v1 - v0;
+    const auto ac = v2 - v0;
+
+    const auto ap = p - v0;
+    const auto d1 = glm::dot(ab, ap);
+    const auto d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f)
+        return v0;
+
+    const auto bp = p - v1;
+    const auto d3 = glm::dot(ab, bp);
+    const auto d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3)
+        return v1;
+
+    const auto vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+        return v0 + d1 / (d1 - d3) * ab;
+
+    const auto cp = p - v2;
+    const auto d5 = glm::dot(ab, cp);
+    const auto d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6)
+        return v2;
+
+    const auto vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+        return v0 + d2 / (d2 - d6) * ac;
+
+    const auto va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+        return v1 + (d4 - d3) / ((d4 - d3) + (d5 - d6)) * (v2 - v1);
+
+    const auto sum = va + vb + vc;
+    if (sum <= 0.0f) {
+        // degenerate triangle, the closest point is on one of the edges
+        const auto q0 = LineSegment { v0, v1 }.closestPoint(p);
+        const auto q1 = LineSegment { v1, v2 }.closestPoint(p);
+        const auto q2 = LineSegment { v2, v0 }.closestPoint(p);
+        const auto distance2 = [&p](const glm::vec3 &q) { return glm::dot(q - p, q - p); };
+        const auto q01 = distance2(q0) < distance2(q1) ? q0 : q1;
+        return distance2(q01) < distance2(q2) ? q01 : q2;
+    }
+    return v0 + (vb / sum) * ab + (vc / sum) * ac;
+}
+
+std::pair<glm::vec3, glm::vec3> Triangle::closestPoints(const LineSegment &segment) const
+{
+    if (const auto t = intersection(segment)) {
+        const auto p = segment.pointAt(*t);
+        return { p, p };
+    }
+
+    std::pair<glm::vec3, glm::vec3> closest;
+    auto closestDistance2 = std::numeric_limits<float>::max();
+    const auto consider = [&closest, &closestDistance2](const glm::vec3 &onTriangle, const glm::vec3 &onSegment) {
+        const auto d = onSegment - onTriangle;
+        const auto distance2 = glm::dot(d, d);
+        if (distance2 < closestDistance2) {
+            closestDistance2 = distance2;
+            closest = { onTriangle, onSegment };
+        }
+    };
+
+    consider(closestPoint(segment.from), segment.from);
+    consider(closestPoint(segment.to), segment.to);
+    for (const auto &edge : { LineSegment { v0, v1 }, LineSegment { v1, v2 }, LineSegment { v2, v0 } }) {
+        const auto [onEdge, onSegment] = edge.closestPoints(segment);
+        consider(onEdge, onSegment);
+    }
+
+    return closest;
+}
+
+namespace {
+
+// normal of the triangle's plane facing against the motion, for shapes that
+// already intersect it
+glm::vec3 facingNormal(const Triangle &triangle, const glm::vec3 &motion)
+{
+    const auto n = glm::cross(triangle.v1 - triangle.v0, triangle.v2 - triangle.v0);
+    const auto length = glm::length(n);
+    if (length == 0.0f)
+        return glm::vec3(0);
+    return glm::dot(n, motion) > 0.0f ? -n / length : n / length;
+}
+
+// smallest non-negative root of a t^2 + 2 b t + c = 0, given that c > 0
+std::optional<float> firstRoot(float a, float b, float c)
+{
+    if (a <= 0.0f)
+        return {};
+    const auto discriminant = b * b - a * c;
+    if (discriminant < 0.0f)
+        return {};
+    const auto t = (-b - std::sqrt(discriminant)) / a;
+    if (t < 0.0f)
+        return {};
+    return t;
+}
+
+// First hit in [0, 1] of a ray against the cylinder around p-q, along with
+// where along p-q it is. Rays starting inside the infinite cylinder or
+// hitting it beyond the ends are ignored, the spheres around p and q handle
+// those.
+std::optional<std::pair<float, float>> rayCylinder(const glm::vec3 &origin, const glm::vec3 &direction, const glm::vec3 &p, const glm::vec3 &q, float radius)
+{
+    const auto d = q - p;
+    const auto m = origin - p;
+    const auto dd = glm::dot(d, d);
+    if (dd == 0.0f)
+        return {};
+    const auto md = glm::dot(m, d);
+    const auto nd = glm::dot(direction, d);
+    const auto a = dd * glm::dot(direction, direction) - nd * nd;
+    const auto b = dd * glm::dot(m, direction) - nd * md;
+    const auto c = dd * (glm::dot(m, m) - radius * radius) - md * md;
+    if (c <= 0.0f)
+        return {};
+    const auto t = firstRoot(a, b, c);
+    if (!t || *t > 1.0f)
+        return {};
+    const auto s = (md + *t * nd) / dd;
+    if (s < 0.0f || s > 1.0f)
+        return {};
+    return std::pair(*t, s);
+}
+
+} // namespace
+
+std::optional<SweepHit> Triangle::sweep(const glm::vec3 &center, float radius, const glm::vec3 &motion) const
+{
+    // already touching?
+    {
+        const auto closest = closestPoint(center);
+        const auto offset = center - closest;
+        const auto distance2 = glm::dot(offset, offset);
+        if (distance2 <= radius * radius) {
+            const auto normal = distance2 > 0.0f ? offset / std::sqrt(distance2) : facingNormal(*this, motion);
+            if (glm::dot(motion, normal) >= 0.0f)
+                return {};
+            return SweepHit { 0.0f, closest, normal };
+        }
+    }
+
+    // the face is hit first if the sphere touches the plane inside the triangle
+    const auto e1 = v1 - v0;
+    const auto e2 = v2 - v0;
+    if (const auto n = facingNormal(*this, motion); n != glm::vec3(0)) {
+        const auto distance = glm::dot(center - v0, n);
+        const auto speed = -glm::dot(motion, n);
+        if (speed > 0.0f && distance > radius) {
+            const auto t = (distance - radius) / speed;
+            if (t <= 1.0f) {
+                const auto p = center + t * motion - radius * n;
+                const auto w = p - v0;
+                const auto d00 = glm::dot(e1, e1);
+                const auto d01 = glm::dot(e1, e2);
+                const auto d11 = glm::dot(e2, e2);
+                const auto d20 = glm::dot(w, e1);
+                const auto d21 = glm::dot(w, e2);
+                const auto denom = d00 * d11 - d01 * d01;
+                const auto u = (d11 * d20 - d01 * d21) / denom;
+                const auto v = (d00 * d21 - d01 * d20) / denom;
+                if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f)
+                    return SweepHit { t, p, n };
+            }
+        }
+    }
+
+    // otherwise it's an edge or a vertex, ie a ray from the center against
+    // cylinders around the edges and spheres around the vertices
+    std::optional<SweepHit> hit;
+    const auto consider = [&hit, &center, &motion](float t, const glm::vec3 &point) {
+        if (t > 1.0f || (hit && hit->t <= t))
+            return;
+        hit = SweepHit { t, point, glm::normalize(center + t * motion - point) };
+    };
+
+    const auto motion2 = glm::dot(motion, motion);
+    for (const auto &v : { v0, v1, v2 }) {
+        const auto m = center - v;
+        if (const auto t = firstRoot(motion2, glm::dot(m, motion), glm::dot(m, m) - radius * radius))
+            consider(*t, v);
+    }
+
+    for (const auto &[p, q] : { std::pair(v0, v1), std::pair(v1, v2), std::pair(v2, v0) }) {
+        if (const auto h = rayCylinder(center, motion, p, q, radius)) {
+            const auto [t, s] = *h;
+            consider(t, p + s * (q - p));
+        }
+    }
+
+    return hit;
+}
+
+std::optional<SweepHit> Triangle::sweep(const Capsule &capsule, const glm::vec3 &motion) const
+{
+    // already touching?
+    {
+        const auto [onTriangle, onAxis] = closestPoints({ capsule.a, capsule.b });
+        const auto offset = onAxis - onTriangle;
+        const auto distance2 = glm::dot(offset, offset);
+        if (distance2 <= capsule.radius * capsule.radius) {
+            const auto normal = distance2 > 0.0f ? offset / std::sqrt(distance2) : facingNormal(*this, motion);
+            if (glm::dot(motion, normal) >= 0.0f)
+                return {};
+            return SweepHit { 0.0f, onTriangle, normal };
+        }
+    }
+
+    // Otherwise the first contact is between the triangle and one of the end
+    // spheres, a vertex and the cylinder, or an edge and the cylinder.
+    std::optional<SweepHit> hit;
+    const auto consider = [&hit](const std::optional<SweepHit> &h) {
+        if (h && (!hit || h->t < hit->t))
+            hit = h;
+    };
+
+    consider(sweep(capsule.a, capsule.radius, motion));
+    consider(sweep(capsule.b, capsule.radius, motion));
+
+    const auto axis = capsule.b - capsule.a;
+
+    // a vertex against the cylinder is the vertex moving the opposite way
+    for (const auto &v : { v0, v1, v2 }) {
+        if (const auto h = rayCylinder(v, -motion, capsule.a, capsule.b, capsule.radius)) {
+            const auto [t, s] = *h;
+            consider(SweepHit { t, v, glm::normalize(capsule.a + s * axis + t * motion - v) });
+        }
+    }
+
+    // The distance between the lines through an edge and through the axis
+    // changes linearly with t. A contact between the inside of both happens
+    // when it reaches the radius with the closest points within both
+    // segments; contacts at the ends are handled above.
+    for (const auto &[p, q] : { std::pair(v0, v1), std::pair(v1, v2), std::pair(v2, v0) }) {
+        const auto edge = q - p;
+        auto n = glm::cross(axis, edge);
+        const auto length2 = glm::dot(n, n);
+        if (length2 <= 1e-12f * glm::dot(axis, axis) * glm::dot(edge, edge))
+            continue; // parallel or degenerate
+        n /= std::sqrt(length2);
+        auto distance = glm::dot(capsule.a - p, n);
+        auto speed = -glm::dot(motion, n);
+        if (distance < 0.0f) {
+            n = -n;
+            distance = -distance;
+            speed = -speed;
+        }
+        if (speed <= 0.0f || distance <= capsule.radius)
+            continue;
+        const auto t = (distance - capsule.radius) / speed;
+        if (t > 1.0f)
+            continue;
+
+        const auto r = capsule.a + t * motion - p;
+        const auto a = glm::dot(axis, axis);
+        const auto b = glm::dot(axis, edge);
+        const auto c = glm::dot(axis, r);
+        const auto e = glm::dot(edge, edge);
+        const auto f = glm::dot(edge, r);
+        const auto denom = a * e - b * b;
+        const auto s = (b * f - c * e) / denom;
+        const auto w = (a * f - b * c) / denom;
+        if (s >= 0.0f && s <= 1.0f && w >= 0.0f && w <= 1.0f)
+            consider(SweepHit { t, p + w * edge, n });
+    }
+
+    return hit;
+}
@@ -2,7 +2,9 @@
 
 #include <glm/glm.hpp>
 
+#include <limits>
 #include <optional>
+#include <utility>
 
 struct Triangle;
 struct Ray;
@@ -16,6 +18,9 @@ struct LineSegment {
     glm::vec3 pointAt(float t) const;
     std::optional<float> intersection(const Triangle &triangle) const;
     bool intersects(const BoundingBox &box) const;
+    glm::vec3 closestPoint(const glm::vec3 &p) const;
+    // closest points between the two segments, on this one first
+    std::pair<glm::vec3, glm::vec3> closestPoints(const LineSegment &other) const;
 };
 
 struct Ray {
@@ -29,14 +34,52 @@ struct Ray {
 
 struct BoundingBox {
     glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
-    glm::vec3 max = glm::vec3(std::numeric_limits<float>::min());
+    glm::vec3 max = glm::vec3(std::numeric_limits<float>::lowest());
 
     bool contains(const glm::vec3 &p) const;
     BoundingBox operator|(const glm::vec3 &p) const;
     BoundingBox &operator|=(const glm::vec3 &p);
+    BoundingBox operator|(const BoundingBox &other) const;
+    BoundingBox &operator|=(const BoundingBox &other);
 
     bool intersects(const LineSegment &segment) const;
     bool intersects(const Ray &ray) const;
+    bool intersects(const BoundingBox &other) const;
+};
+
+// A ray prepared for testing against many boxes. The reciprocal direction is
+// computed once so that slab tests don't divide, with zero components
+// replaced by a tiny value of the same sign so that axis-parallel rays don't
+// produce NaN slabs. Only the [0, tMax] part of the ray is considered; users
+// can shrink tMax as they find closer hits.
+struct RayQuery {
+    Ray ray;
+    glm::vec3 invDirection;
+    int octant; // bit i is set if the direction is negative along axis i
+    float tMax;
+
+    explicit RayQuery(const Ray &ray, float tMax = std::numeric_limits<float>::max());
+    explicit RayQuery(const LineSegment &segment);
+
+    glm::vec3 slabT(const glm::vec3 &p) const { return (p - ray.origin) * invDirection; }
+    // values of t where the ray enters and leaves the box, tClose > tFar if
+    // the line misses it
+    std::pair<float, float> intersectionRange(const BoundingBox &box) const;
+    bool intersects(const BoundingBox &box) const;
+};
+
+struct Capsule {
+    glm::vec3 a, b;
+    float radius;
+};
+
+// First contact of a shape moving by some offset: t is the fraction of the
+// offset travelled before the contact, normal points from the geometry
+// towards the shape.
+struct SweepHit {
+    float t;
+    glm::vec3 point;
+    glm::vec3 normal;
 };
 
 struct Triangle {
@@ -44,4 +87,13 @@ struct Triangle {
 
     std::optional<float> intersection(const LineSegment &segment) const;
     std::optional<float> intersection(const Ray &ray) const;
+    glm::vec3 closestPoint(const glm::vec3 &p) const;
+    bool intersects(const BoundingBox &box) const;
+    // closest points between the triangle and the segment, on the triangle first
+    std::pair<glm::vec3, glm::vec3> closestPoints(const LineSegment &segment) const;
+
+    // Shapes already touching the triangle only hit it if they move further
+    // into it, so that they can slide along or move away.
+    std::optional<SweepHit> sweep(const glm::vec3 &center, float radius, const glm::vec3 &motion) const;
+    std::optional<SweepHit> sweep(const Capsule &capsule, const glm::vec3 &motion) const;
 };
@@ -1,6 +1,10 @@
 #include "level.h"
 
+#include "benchmark.h"
+#include "bvh.h"
 #include "datastream.h"
+#include "distancefield.h"
+#include "levelfile.h"
 #include "material.h"
 #include "mesh.h"
 #include "octree.h"
@@ -10,17 +14,64 @@
 
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
+#include <chrono>
+#include <future>
 #include <limits>
 
+#define BENCHMARK_COLLISION_BACKENDS 0
+#define BENCHMARK_TRIANGLE_KERNELS 0
+#define BENCHMARK_CLOSEST_POINTS 0
+#define BENCHMARK_DISTANCE_FIELD 0
+#define BENCHMARK_OCTREE_UPDATES 0
+
+namespace {
+constexpr auto DistanceFieldVoxelSize = 0.25f;
+constexpr auto DistanceFieldBandWidth = 2.0f;
+
+template<typename T>
+bool isReady(const std::future<T> &future)
+{
+    return future.valid() && future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+} // namespace
+
+// Face changes go through three stages: queued until the octree worker is
+// free, then being applied by it, then applied to m_faces and the octree.
+struct Level::Edits {
+    std::vector<uint32_t> removedFaces;
+    std::vector<Face> addedFaces;
+
+    struct OctreeRebuild {
+        std::unique_ptr<Octree::Update> update; // in place, or of the whole tree
+        std::vector<Triangle> triangles; // of the edited level, for the rest
+    };
+    std::vector<uint32_t> rebuildingRemovedFaces;
+    std::vector<Face> rebuildingAddedFaces;
+    std::future<OctreeRebuild> octreeTask;
+
+    struct Rebuild {
+        std::unique_ptr<DistanceField> distanceField;
+        std::unique_ptr<BVH> bvh;
+    };
+    std::vector<Triangle> staleTriangles; // the next rebuild's, if needed
+    bool stale = false;
+    bool staleBVH = false; // the BVH is built right away on load
+    std::future<Rebuild> task;
+};
+
 Level::Level()
     : m_octree(new Octree)
+    , m_edits(new Edits)
 {
 }
 
 Level::~Level() = default;
 
-bool Level::load(const char *filepath)
+bool Level::load(const char *filepath, CollisionBackend collisionBackend)
 {
+    m_collisionBackend = collisionBackend;
+
     DataStream ds(filepath);
     if (!ds) {
         spdlog::error("Failed to open {}", filepath);
@@ -39,82 +90,93 @@ bool Level::load(const char *filepath)
 
 bool Level::load(DataStream &ds)
 {
-    std::vector<Face> faces;
-
-    uint32_t meshCount;
-    ds >> meshCount;
-
-    for (int i = 0; i < meshCount; ++i) {
-        MaterialKey materialKey;
-        ds >> materialKey;
-        const auto *material = cachedMaterial(materialKey);
+    std::vector<LevelMesh> meshes;
+    if (!readLevelMeshes(ds, meshes))
+        return false;
 
-        std::vector<MeshVertex> vertices;
-        ds >> vertices;
+    std::vector<const Material *> materials;
+    materials.reserve(meshes.size());
+    for (const auto &mesh : meshes)
+        materials.push_back(cachedMaterial(mesh.materialKey));
 
-        uint32_t faceCount;
-        ds >> faceCount;
+    m_faces = levelFaces(meshes, materials);
+    const auto &faces = m_faces;
 
+#if DRAW_RAW_LEVEL_MESHES
+    for (std::size_t i = 0; i < meshes.size(); ++i) {
+        const auto &vertices = meshes[i].vertices;
         std::vector<unsigned> indices;
-
-        for (int i = 0; i < faceCount; ++i) {
-            uint8_t faceIndexCount;
-            ds >> faceIndexCount;
-
-            std::vector<uint32_t> faceIndices;
-            faceIndices.reserve(faceIndexCount);
-            for (int j = 0; j < faceIndexCount; ++j) {
-                uint32_t index;
-                ds >> index;
-                faceIndices.push_back(index);
-            }
-
-            Face face;
-            face.material = material;
-            for (const auto &index : faceIndices) {
-                const auto &v = vertices[index];
-                face.vertices.push_back({ v.position, v.normal, v.texcoord });
-            }
-            faces.push_back(face);
-
-            for (int j = 1; j < faceIndexCount - 1; ++j) {
+        for (const auto &faceIndices : meshes[i].faces) {
+            for (int j = 1; j < static_cast<int>(faceIndices.size()) - 1; ++j) {
                 indices.push_back(faceIndices[0]);
                 indices.push_back(faceIndices[j]);
                 indices.push_back(faceIndices[j + 1]);
+                m_triangles.push_back({ vertices[faceIndices[0]].position, vertices[faceIndices[j]].position, vertices[faceIndices[j + 1]].position });
             }
-
-#if DRAW_RAW_LEVEL_MESHES
-            for (int j = 1; j < faceIndexCount - 1; ++j) {
-                const auto &v0 = vertices[faceIndices[0]];
-                const auto &v1 = vertices[faceIndices[j]];
-                const auto &v2 = vertices[faceIndices[j + 1]];
-                m_triangles.push_back({ v0.position, v1.position, v2.position });
-            }
-#endif
         }
-
-#if DRAW_RAW_LEVEL_MESHES
         auto mesh = makeMesh(GL_TRIANGLES, vertices, indices);
-        m_meshes.push_back({ std::move(mesh), material });
+        m_meshes.push_back({ std::move(mesh), materials[i] });
+    }
 #endif
+
+    // levels baked with bakelevel have the octree appended to them
+    if (ds.atEnd()) {
+        m_octree->initialize(faces);
+    } else if (!m_octree->read(ds, materials)) {
+        spdlog::warn("Ignoring malformed or outdated baked octree");
+        m_octree->initialize(faces);
+    }
+
+    if (m_collisionBackend == CollisionBackend::BVH) {
+        m_bvh = std::make_unique<BVH>();
+        m_bvh->initialize(triangulate(faces));
+    } else {
+        m_bvh.reset();
     }
 
-    m_octree->initialize(faces);
+    // the distance field is sampled in the background, the octree answers
+    // distance queries until it's done
+    m_distanceField.reset();
+    m_edits->staleTriangles = triangulate(faces);
+    m_edits->stale = true;
+    m_edits->staleBVH = false;
+    startRebuilds();
+
+#if BENCHMARK_COLLISION_BACKENDS
+    benchmarkCollisionBackends(faces);
+#endif
+#if BENCHMARK_TRIANGLE_KERNELS
+    benchmarkTriangleKernels(triangulate(faces));
+#endif
+#if BENCHMARK_CLOSEST_POINTS
+    benchmarkClosestPoints(faces);
+#endif
+#if BENCHMARK_DISTANCE_FIELD
+    benchmarkDistanceField(faces, DistanceFieldBandWidth);
+#endif
+#if BENCHMARK_OCTREE_UPDATES
+    benchmarkOctreeUpdates(faces);
+#endif
 
     return true;
 }
 
-void Level::render(Renderer *renderer) const
+void Level::render(Renderer *renderer, const glm::vec3 &viewpoint) const
 {
 #if DRAW_RAW_LEVEL_MESHES
     for (const auto &m : m_meshes) {
         renderer->render(m.mesh.get(), m.material, glm::mat4(1));
     }
 #else
-    m_octree->render(renderer, glm::mat4(1));
+    m_octree->render(renderer, glm::mat4(1), viewpoint);
 #endif
 }
 
+BoundingBox Level::boundingBox() const
+{
+    return m_octree->boundingBox();
+}
+
 std::optional<glm::vec3> Level::findCollision(const LineSegment &segment) const
 {
 #if DRAW_RAW_LEVEL_MESHES
@@ -131,6 +193,189 @@ std::optional<glm::vec3> Level::findCollision(const LineSegment &segment) const
     }
     return collision;
 #else
+    if (m_collisionBackend == CollisionBackend::BVH)
+        return m_bvh->findCollision(segment);
     return m_octree->findCollision(segment);
 #endif
 }
+
+void Level::findCollisions(const std::vector<LineSegment> &segments, std::vector<std::optional<glm::vec3>> &collisions) const
+{
+#if !DRAW_RAW_LEVEL_MESHES
+    if (m_collisionBackend == CollisionBackend::Octree) {
+        m_octree->findCollisions(segments, collisions);
+        return;
+    }
+#endif
+    collisions.resize(segments.size());
+    std::transform(segments.begin(), segments.end(), collisions.begin(), [this](const LineSegment &segment) {
+        return findCollision(segment);
+    });
+}
+
+bool Level::isOccluded(const LineSegment &segment) const
+{
+#if DRAW_RAW_LEVEL_MESHES
+    return std::any_of(m_triangles.begin(), m_triangles.end(), [&segment](const Triangle &triangle) {
+        return segment.intersection(triangle).has_value();
+    });
+#else
+    if (m_collisionBackend == CollisionBackend::BVH)
+        return m_bvh->intersectsAny(segment);
+    return m_octree->intersectsAny(segment);
+#endif
+}
+
+std::optional<SweepHit> Level::sweepSphere(const glm::vec3 &center, float radius, const glm::vec3 &motion) const
+{
+    return m_octree->sweepSphere(center, radius, motion);
+}
+
+std::optional<SweepHit> Level::sweepCapsule(const Capsule &capsule, const glm::vec3 &motion) const
+{
+    return m_octree->sweepCapsule(capsule, motion);
+}
+
+std::optional<glm::vec3> Level::closestPoint(const glm::vec3 &point, float maxDistance) const
+{
+    return m_octree->closestPoint(point, maxDistance);
+}
+
+void Level::closestPoints(const std::vector<glm::vec3> &points, float maxDistance, std::vector<std::optional<glm::vec3>> &closest) const
+{
+    m_octree->closestPoints(points, maxDistance, closest);
+}
+
+float Level::distance(const glm::vec3 &point) const
+{
+    if (!m_distanceField) {
+        const auto closest = m_octree->closestPoint(point, DistanceFieldBandWidth);
+        return closest ? glm::length(*closest - point) : DistanceFieldBandWidth;
+    }
+    return m_distanceField->distance(point);
+}
+
+glm::vec3 Level::gradient(const glm::vec3 &point) const
+{
+    if (!m_distanceField) {
+        const auto closest = m_octree->closestPoint(point, DistanceFieldBandWidth);
+        if (!closest)
+            return glm::vec3(0);
+        const auto offset = point - *closest;
+        const auto length = glm::length(offset);
+        return length > 0.0f ? offset / length : glm::vec3(0);
+    }
+    return m_distanceField->gradient(point);
+}
+
+float Level::distanceBandWidth() const
+{
+    return DistanceFieldBandWidth;
+}
+
+uint32_t Level::addFaces(std::vector<Face> faces)
+{
+    auto &edits = *m_edits;
+    const auto first = static_cast<uint32_t>(m_faces.size() + edits.rebuildingAddedFaces.size() + edits.addedFaces.size());
+    std::move(faces.begin(), faces.end(), std::back_inserter(edits.addedFaces));
+    startRebuilds();
+    return first;
+}
+
+void Level::removeFaces(const std::vector<uint32_t> &faces)
+{
+    auto &edits = *m_edits;
+    const auto firstQueued = m_faces.size() + edits.rebuildingAddedFaces.size();
+    for (const auto face : faces) {
+        // faces still queued to be added are just dropped
+        if (face >= firstQueued) {
+            if (face - firstQueued < edits.addedFaces.size())
+                edits.addedFaces[face - firstQueued].vertices.clear();
+        } else {
+            edits.removedFaces.push_back(face);
+        }
+    }
+    startRebuilds();
+}
+
+bool Level::update()
+{
+    auto &edits = *m_edits;
+    bool changed = false;
+
+    if (isReady(edits.octreeTask)) {
+        auto rebuild = edits.octreeTask.get();
+        for (const auto face : edits.rebuildingRemovedFaces) {
+            if (face < m_faces.size())
+                m_faces[face].vertices.clear();
+        }
+        std::move(edits.rebuildingAddedFaces.begin(), edits.rebuildingAddedFaces.end(), std::back_inserter(m_faces));
+        edits.rebuildingRemovedFaces.clear();
+        edits.rebuildingAddedFaces.clear();
+        m_octree->applyUpdate(*rebuild.update);
+        edits.staleTriangles = std::move(rebuild.triangles);
+        edits.stale = true;
+        edits.staleBVH = true;
+        changed = true;
+    }
+
+    if (isReady(edits.task)) {
+        auto rebuild = edits.task.get();
+        m_distanceField = std::move(rebuild.distanceField);
+        if (rebuild.bvh)
+            m_bvh = std::move(rebuild.bvh);
+    }
+
+    startRebuilds();
+    return changed;
+}
+
+// Starts the rebuilds that have something to do and aren't already running;
+// a future from std::async can't be replaced before it's done without
+// blocking on it.
+void Level::startRebuilds()
+{
+    auto &edits = *m_edits;
+
+    if (!edits.octreeTask.valid() && (!edits.removedFaces.empty() || !edits.addedFaces.empty())) {
+        edits.rebuildingRemovedFaces = std::move(edits.removedFaces);
+        edits.rebuildingAddedFaces = std::move(edits.addedFaces);
+        edits.removedFaces.clear();
+        edits.addedFaces.clear();
+        // m_faces and the octree only change once the task is done
+        edits.octreeTask = std::async(std::launch::async, [this, &edits] {
+            Edits::OctreeRebuild rebuild;
+            rebuild.update = m_octree->prepareUpdate(m_faces, edits.rebuildingRemovedFaces, edits.rebuildingAddedFaces, Octree::BuildParams());
+            auto faces = m_faces;
+            for (const auto face : edits.rebuildingRemovedFaces) {
+                if (face < faces.size())
+                    faces[face].vertices.clear();
+            }
+            faces.insert(faces.end(), edits.rebuildingAddedFaces.begin(), edits.rebuildingAddedFaces.end());
+            if (!rebuild.update) {
+                // Morton or clipped trees, or faces outside the tree; the new
+                // one is built top down, so the next edits can be made in place
+                spdlog::warn("Level octree can't be updated in place, building it again");
+                rebuild.update = m_octree->prepareBuild(faces, Octree::BuildParams());
+            }
+            rebuild.triangles = triangulate(faces);
+            return rebuild;
+        });
+    }
+
+    if (!edits.task.valid() && edits.stale) {
+        edits.stale = false;
+        edits.task = std::async(std::launch::async, [triangles = std::move(edits.staleTriangles), withBVH = edits.staleBVH && m_collisionBackend == CollisionBackend::BVH] {
+            Edits::Rebuild rebuild;
+            rebuild.distanceField = std::make_unique<DistanceField>();
+            rebuild.distanceField->initialize(triangles, DistanceFieldVoxelSize, DistanceFieldBandWidth);
+            if (withBVH) {
+                rebuild.bvh = std::make_unique<BVH>();
+                rebuild.bvh->initialize(triangles);
+            }
+            return rebuild;
+        });
+        edits.staleTriangles.clear();
+        edits.staleBVH = false;
+    }
+}
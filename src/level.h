@@ -11,7 +11,10 @@ class Mesh;
 class Material;
 class Renderer;
 class Octree;
+class BVH;
+class DistanceField;
 class DataStream;
+struct Face;
 
 #define DRAW_RAW_LEVEL_MESHES 0
 
@@ -21,12 +24,58 @@ public:
     Level();
     ~Level();
 
-    bool load(const char *path);
-    void render(Renderer *renderer) const;
+    enum class CollisionBackend {
+        Octree,
+        BVH
+    };
+
+    bool load(const char *path, CollisionBackend collisionBackend = CollisionBackend::Octree);
+    // Only renders what's potentially visible from the viewpoint if the
+    // level was baked with visibility sets.
+    void render(Renderer *renderer, const glm::vec3 &viewpoint) const;
+    BoundingBox boundingBox() const;
     std::optional<glm::vec3> findCollision(const LineSegment &segment) const;
+    void findCollisions(const std::vector<LineSegment> &segments, std::vector<std::optional<glm::vec3>> &collisions) const;
+    // Line of sight test: whether anything in the level blocks the segment.
+    bool isOccluded(const LineSegment &segment) const;
+    // First contact of a sphere or capsule moving by the given offset. These
+    // and the closest point queries always go through the octree, whatever
+    // the collision backend.
+    std::optional<SweepHit> sweepSphere(const glm::vec3 &center, float radius, const glm::vec3 &motion) const;
+    std::optional<SweepHit> sweepCapsule(const Capsule &capsule, const glm::vec3 &motion) const;
+    // Closest point of the level geometry, if there's any within maxDistance.
+    std::optional<glm::vec3> closestPoint(const glm::vec3 &point, float maxDistance) const;
+    void closestPoints(const std::vector<glm::vec3> &points, float maxDistance, std::vector<std::optional<glm::vec3>> &closest) const;
+    // Approximate distance to the level geometry and its gradient, looked up
+    // in a distance field sampled in the background after load, for foes to
+    // steer clear of walls. Cheap enough to call for every ship every tick,
+    // but only meaningful up to distanceBandWidth(): further away the
+    // distance is clamped and the gradient is zero. Until update() swaps the
+    // field in, they're exact and go through the octree, which is slower.
+    float distance(const glm::vec3 &point) const;
+    glm::vec3 gradient(const glm::vec3 &point) const;
+    float distanceBandWidth() const;
+
+    // Runtime changes to the geometry, for destroyed walls or opened doors.
+    // Faces are numbered in the order of the level file, added ones take the
+    // next numbers; addFaces returns the first of them. Only the octree
+    // leaves the changes touch are rebuilt, on a worker thread, and update()
+    // swaps them in when they're ready, usually by the next frame. Edits the
+    // octree can't make in place rebuild it whole, on the worker thread too;
+    // update() then only creates its meshes. Until then queries and
+    // rendering see the level as it was, and further changes wait for the
+    // next rebuild. The distance field, and the BVH if it's the
+    // collision backend, are rebuilt whole in the background afterwards.
+    uint32_t addFaces(std::vector<Face> faces);
+    void removeFaces(const std::vector<uint32_t> &faces);
+    // Applies the rebuilds that are done, from the render thread. The queries
+    // above can run from several threads at once, but not during update().
+    // Returns whether the geometry changed.
+    bool update();
 
 private:
     bool load(DataStream &ds);
+    void startRebuilds();
 #if DRAW_RAW_LEVEL_MESHES
     struct MeshMaterial {
         std::unique_ptr<Mesh> mesh;
@@ -36,4 +85,11 @@ private:
     std::vector<Triangle> m_triangles;
 #endif
     std::unique_ptr<Octree> m_octree;
+    std::unique_ptr<BVH> m_bvh;
+    std::unique_ptr<DistanceField> m_distanceField;
+    CollisionBackend m_collisionBackend = CollisionBackend::Octree;
+    std::vector<Face> m_faces; // removed ones are left empty
+    // last, its tasks use the members above
+    struct Edits;
+    std::unique_ptr<Edits> m_edits;
 };
@@ -0,0 +1,56 @@
+#include "levelfile.h"
+
+#include "datastream.h"
+#include "octree.h"
+
+bool readLevelMeshes(DataStream &ds, std::vector<LevelMesh> &meshes)
+{
+    uint32_t meshCount;
+    ds >> meshCount;
+    if (!ds)
+        return false;
+
+    meshes.resize(meshCount);
+    for (auto &mesh : meshes) {
+        ds >> mesh.materialKey;
+        ds >> mesh.vertices;
+
+        uint32_t faceCount;
+        ds >> faceCount;
+        if (!ds)
+            return false;
+
+        mesh.faces.resize(faceCount);
+        for (auto &face : mesh.faces) {
+            uint8_t faceIndexCount;
+            ds >> faceIndexCount;
+
+            face.reserve(faceIndexCount);
+            for (int j = 0; j < faceIndexCount; ++j) {
+                uint32_t index;
+                ds >> index;
+                face.push_back(index);
+            }
+        }
+    }
+
+    return static_cast<bool>(ds);
+}
+
+std::vector<Face> levelFaces(const std::vector<LevelMesh> &meshes, const std::vector<const Material *> &materials)
+{
+    std::vector<Face> faces;
+    for (std::size_t i = 0; i < meshes.size(); ++i) {
+        const auto &mesh = meshes[i];
+        for (const auto &faceIndices : mesh.faces) {
+            Face face;
+            face.material = materials[i];
+            for (const auto &index : faceIndices) {
+                const auto &v = mesh.vertices[index];
+                face.vertices.push_back({ v.position, v.normal, v.texcoord });
+            }
+            faces.push_back(face);
+        }
+    }
+    return faces;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "material.h"
+#include "mesh.h"
+
+#include <cstdint>
+#include <vector>
+
+class DataStream;
+struct Face;
+
+// Polygon mesh as stored in level files, see doc/EntityFile.txt
+struct LevelMesh {
+    MaterialKey materialKey;
+    std::vector<MeshVertex> vertices;
+    std::vector<std::vector<uint32_t>> faces; // indices into vertices
+};
+
+bool readLevelMeshes(DataStream &ds, std::vector<LevelMesh> &meshes);
+
+// materials[i] is the material of meshes[i]
+std::vector<Face> levelFaces(const std::vector<LevelMesh> &meshes, const std::vector<const Material *> &materials);
@@ -0,0 +1,228 @@
+#pragma once
+
+#include "geometryutils.h"
+
+#include <glm/glm.hpp>
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Loose octree for objects that move every tick (Ulrich, "Loose Octrees",
+// Game Programming Gems). The bounds of each node are twice the size of its
+// cell, so an object bounded by a sphere fits in any node whose cell contains
+// its center and is at least twice as wide as its radius. That node is found
+// directly from the radius and the center, without testing any bounds, which
+// keeps inserting and moving cheap. Nodes are created as needed and kept
+// around when they become empty, but queries skip subtrees with no objects.
+template<typename T>
+class LooseOctree
+{
+public:
+    using Handle = uint32_t;
+
+    explicit LooseOctree(const BoundingBox &bounds, int maxDepth = 6);
+
+    Handle insert(const T &value, const glm::vec3 &center, float radius);
+    void move(Handle handle, const glm::vec3 &center, float radius);
+    void remove(Handle handle);
+
+    const T &value(Handle handle) const { return m_objects[handle].value; }
+    std::size_t size() const { return m_objects.size() - m_freeHandles.size(); }
+
+    // Calls f(value) for each object whose bounding sphere overlaps the box
+    // or the segment.
+    template<typename F>
+    void query(const BoundingBox &box, F &&f) const;
+    template<typename F>
+    void query(const LineSegment &segment, F &&f) const;
+
+private:
+    struct Object {
+        T value;
+        glm::vec3 center;
+        float radius;
+        uint32_t node;
+        uint32_t slot; // index in the node's object list
+    };
+
+    struct Node {
+        glm::vec3 center;
+        float halfSize; // of the cell, the loose bounds are twice as large
+        int depth;
+        uint32_t parent;
+        uint32_t subtreeObjectCount;
+        std::array<uint32_t, 8> children; // 0 for children not created yet
+        std::vector<Handle> objects;
+    };
+
+    uint32_t findNode(const glm::vec3 &center, float radius);
+    void link(Handle handle, uint32_t nodeIndex);
+    void unlink(Handle handle);
+    template<typename NodeOverlaps, typename ObjectOverlaps, typename F>
+    void query(uint32_t nodeIndex, const NodeOverlaps &nodeOverlaps, const ObjectOverlaps &objectOverlaps, F &f) const;
+
+    int m_maxDepth;
+    std::vector<Node> m_nodes;
+    std::vector<Object> m_objects;
+    std::vector<Handle> m_freeHandles;
+};
+
+template<typename T>
+LooseOctree<T>::LooseOctree(const BoundingBox &bounds, int maxDepth)
+    : m_maxDepth(maxDepth)
+{
+    const auto size = bounds.max - bounds.min;
+    const auto halfSize = 0.5f * std::max(size.x, std::max(size.y, size.z));
+    m_nodes.push_back({ 0.5f * (bounds.min + bounds.max), halfSize, 0, 0, 0, {}, {} });
+}
+
+template<typename T>
+typename LooseOctree<T>::Handle LooseOctree<T>::insert(const T &value, const glm::vec3 &center, float radius)
+{
+    Handle handle;
+    if (!m_freeHandles.empty()) {
+        handle = m_freeHandles.back();
+        m_freeHandles.pop_back();
+        m_objects[handle] = { value, center, radius, 0, 0 };
+    } else {
+        handle = m_objects.size();
+        m_objects.push_back({ value, center, radius, 0, 0 });
+    }
+    link(handle, findNode(center, radius));
+    return handle;
+}
+
+template<typename T>
+void LooseOctree<T>::move(Handle handle, const glm::vec3 &center, float radius)
+{
+    auto &object = m_objects[handle];
+    object.center = center;
+    object.radius = radius;
+    const auto nodeIndex = findNode(center, radius);
+    if (nodeIndex != object.node) {
+        unlink(handle);
+        link(handle, nodeIndex);
+    }
+}
+
+template<typename T>
+void LooseOctree<T>::remove(Handle handle)
+{
+    unlink(handle);
+    m_freeHandles.push_back(handle);
+}
+
+template<typename T>
+uint32_t LooseOctree<T>::findNode(const glm::vec3 &center, float radius)
+{
+    // objects outside of the root cell stay in the root, which is never culled
+    const auto &root = m_nodes.front();
+    const auto offset = glm::abs(center - root.center);
+    if (offset.x > root.halfSize || offset.y > root.halfSize || offset.z > root.halfSize)
+        return 0;
+
+    // deepest level whose cells are at least twice the radius
+    auto depth = m_maxDepth;
+    if (radius > 0.0f)
+        depth = std::min(depth, static_cast<int>(std::floor(std::log2(root.halfSize / radius))));
+
+    uint32_t nodeIndex = 0;
+    while (m_nodes[nodeIndex].depth < depth) {
+        const auto &node = m_nodes[nodeIndex];
+        const auto octant = (center.x > node.center.x ? 1 : 0) | (center.y > node.center.y ? 2 : 0) | (center.z > node.center.z ? 4 : 0);
+        auto child = node.children[octant];
+        if (child == 0) {
+            child = m_nodes.size();
+            const auto halfSize = 0.5f * node.halfSize;
+            const auto sign = glm::vec3((octant & 1) ? 1 : -1, (octant & 2) ? 1 : -1, (octant & 4) ? 1 : -1);
+            Node childNode { node.center + halfSize * sign, halfSize, node.depth + 1, nodeIndex, 0, {}, {} };
+            m_nodes[nodeIndex].children[octant] = child;
+            m_nodes.push_back(std::move(childNode));
+        }
+        nodeIndex = child;
+    }
+    return nodeIndex;
+}
+
+template<typename T>
+void LooseOctree<T>::link(Handle handle, uint32_t nodeIndex)
+{
+    auto &object = m_objects[handle];
+    auto &objects = m_nodes[nodeIndex].objects;
+    object.node = nodeIndex;
+    object.slot = objects.size();
+    objects.push_back(handle);
+    for (auto index = nodeIndex; index != 0; index = m_nodes[index].parent)
+        ++m_nodes[index].subtreeObjectCount;
+    ++m_nodes.front().subtreeObjectCount;
+}
+
+template<typename T>
+void LooseOctree<T>::unlink(Handle handle)
+{
+    const auto &object = m_objects[handle];
+    auto &objects = m_nodes[object.node].objects;
+    const auto last = objects.back();
+    objects[object.slot] = last;
+    m_objects[last].slot = object.slot;
+    objects.pop_back();
+    for (auto index = object.node; index != 0; index = m_nodes[index].parent)
+        --m_nodes[index].subtreeObjectCount;
+    --m_nodes.front().subtreeObjectCount;
+}
+
+template<typename T>
+template<typename F>
+void LooseOctree<T>::query(const BoundingBox &box, F &&f) const
+{
+    const auto nodeOverlaps = [&box](const BoundingBox &nodeBox) {
+        return box.intersects(nodeBox);
+    };
+    const auto objectOverlaps = [&box](const glm::vec3 &center, float radius) {
+        const auto closest = glm::clamp(center, box.min, box.max);
+        return glm::dot(closest - center, closest - center) <= radius * radius;
+    };
+    query(0, nodeOverlaps, objectOverlaps, f);
+}
+
+template<typename T>
+template<typename F>
+void LooseOctree<T>::query(const LineSegment &segment, F &&f) const
+{
+    const RayQuery ray(segment);
+    const auto nodeOverlaps = [&ray](const BoundingBox &nodeBox) {
+        return ray.intersects(nodeBox);
+    };
+    const auto objectOverlaps = [&segment](const glm::vec3 &center, float radius) {
+        const auto closest = segment.closestPoint(center);
+        return glm::dot(closest - center, closest - center) <= radius * radius;
+    };
+    query(0, nodeOverlaps, objectOverlaps, f);
+}
+
+template<typename T>
+template<typename NodeOverlaps, typename ObjectOverlaps, typename F>
+void LooseOctree<T>::query(uint32_t nodeIndex, const NodeOverlaps &nodeOverlaps, const ObjectOverlaps &objectOverlaps, F &f) const
+{
+    const auto &node = m_nodes[nodeIndex];
+    if (node.subtreeObjectCount == 0)
+        return;
+    if (nodeIndex != 0) {
+        const auto looseHalfSize = glm::vec3(2.0f * node.halfSize);
+        if (!nodeOverlaps(BoundingBox { node.center - looseHalfSize, node.center + looseHalfSize }))
+            return;
+    }
+
+    for (const auto handle : node.objects) {
+        const auto &object = m_objects[handle];
+        if (objectOverlaps(object.center, object.radius))
+            f(object.value);
+    }
+
+    for (const auto child : node.children) {
+        if (child != 0)
+            query(child, nodeOverlaps, objectOverlaps, f);
+    }
+}
@@ -119,6 +119,11 @@ DataStream &operator>>(DataStream &ds, MeshVertex &v)
     return ds;
 }
 
+DataWriter &operator<<(DataWriter &dw, const MeshVertex &v)
+{
+    return dw << v.position << v.normal << v.texcoord;
+}
+
 std::unique_ptr<Mesh> makeMesh(GLenum primitive, const std::vector<MeshVertex> &vertices, const std::vector<Mesh::IndexType> &indices)
 {
     auto mesh = std::make_unique<Mesh>(primitive);
@@ -9,6 +9,7 @@
 #include <vector>
 
 class DataStream;
+class DataWriter;
 
 class Mesh : private NonCopyable
 {
@@ -53,5 +54,6 @@ struct MeshVertex {
 };
 
 DataStream &operator>>(DataStream &ds, MeshVertex &v);
+DataWriter &operator<<(DataWriter &dw, const MeshVertex &v);
 
 std::unique_ptr<Mesh> makeMesh(GLenum primitive, const std::vector<MeshVertex> &vertices, const std::vector<Mesh::IndexType> &indices);
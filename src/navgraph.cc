@@ -0,0 +1,264 @@
+#include "navgraph.h"
+
+#include "level.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+
+namespace {
+constexpr auto MaxDepth = 16; // cell positions are packed in 16 bits per axis
+}
+
+void NavGraph::initialize(const Level &level, float clearance, float minCellSize)
+{
+    m_boundingBox = level.boundingBox();
+    m_clearance = clearance;
+    m_minCellSize = minCellSize;
+    m_cells.clear();
+    m_cellIndices.clear();
+    m_linkOffsets.assign(1, 0);
+    m_links.clear();
+
+    const auto size = m_boundingBox.max - m_boundingBox.min;
+    const auto maxSize = std::max(size.x, std::max(size.y, size.z));
+    if (!(maxSize > 0.0f))
+        return;
+    m_maxDepth = std::clamp(static_cast<int>(std::floor(std::log2(maxSize / minCellSize))), 0, MaxDepth);
+
+    initializeCell(level, 0, glm::ivec3(0));
+    linkCells();
+}
+
+uint64_t NavGraph::cellKey(int depth, const glm::ivec3 &position)
+{
+    return (static_cast<uint64_t>(depth) << 48) | (static_cast<uint64_t>(position.x) << 32) | (static_cast<uint64_t>(position.y) << 16) | static_cast<uint64_t>(position.z);
+}
+
+BoundingBox NavGraph::cellBox(int depth, const glm::ivec3 &position) const
+{
+    const auto cellSize = (m_boundingBox.max - m_boundingBox.min) / static_cast<float>(1 << depth);
+    return { m_boundingBox.min + glm::vec3(position) * cellSize, m_boundingBox.min + glm::vec3(position + 1) * cellSize };
+}
+
+void NavGraph::initializeCell(const Level &level, int depth, const glm::ivec3 &position)
+{
+    const auto box = cellBox(depth, position);
+    const auto center = 0.5f * (box.min + box.max);
+    const auto radius = 0.5f * glm::length(box.max - box.min);
+
+    bool isFree;
+    if (!level.closestPoint(center, radius + m_clearance)) {
+        isFree = true;
+    } else if (depth == m_maxDepth) {
+        isFree = !level.closestPoint(center, m_clearance);
+    } else {
+        for (int octant = 0; octant < 8; ++octant)
+            initializeCell(level, depth + 1, 2 * position + glm::ivec3(octant & 1, (octant >> 1) & 1, octant >> 2));
+        return;
+    }
+
+    if (isFree) {
+        m_cellIndices[cellKey(depth, position)] = m_cells.size();
+        m_cells.push_back({ box, depth, position });
+    }
+}
+
+uint32_t NavGraph::findCell(int depth, const glm::ivec3 &position) const
+{
+    // the cell at that depth or its first ancestor that is a cell
+    for (int ancestorDepth = depth; ancestorDepth >= 0; --ancestorDepth) {
+        const auto shift = depth - ancestorDepth;
+        const auto it = m_cellIndices.find(cellKey(ancestorDepth, glm::ivec3(position.x >> shift, position.y >> shift, position.z >> shift)));
+        if (it != m_cellIndices.end())
+            return it->second;
+    }
+    return NoCell;
+}
+
+uint32_t NavGraph::findCell(const glm::vec3 &point) const
+{
+    if (m_cells.empty() || !m_boundingBox.contains(point))
+        return NoCell;
+
+    const auto gridSize = 1 << m_maxDepth;
+    const auto cellSize = (m_boundingBox.max - m_boundingBox.min) / static_cast<float>(gridSize);
+    const auto position = glm::clamp(glm::ivec3(glm::floor((point - m_boundingBox.min) / cellSize)), glm::ivec3(0), glm::ivec3(gridSize - 1));
+    if (const auto cell = findCell(m_maxDepth, position); cell != NoCell)
+        return cell;
+
+    // ships can get closer to the geometry than the clearance, fall back to
+    // the closest cell around the smallest blocked one
+    auto closestCell = NoCell;
+    auto closestDistance2 = std::numeric_limits<float>::max();
+    for (int z = -1; z <= 1; ++z) {
+        for (int y = -1; y <= 1; ++y) {
+            for (int x = -1; x <= 1; ++x) {
+                const auto neighbor = position + glm::ivec3(x, y, z);
+                if (neighbor.x < 0 || neighbor.y < 0 || neighbor.z < 0 || neighbor.x >= gridSize || neighbor.y >= gridSize || neighbor.z >= gridSize)
+                    continue;
+                const auto cell = findCell(m_maxDepth, neighbor);
+                if (cell == NoCell)
+                    continue;
+                const auto offset = cellCenter(cell) - point;
+                const auto distance2 = glm::dot(offset, offset);
+                if (distance2 < closestDistance2) {
+                    closestDistance2 = distance2;
+                    closestCell = cell;
+                }
+            }
+        }
+    }
+    return closestCell;
+}
+
+void NavGraph::linkCells()
+{
+    // Each cell looks for the cell across each of its faces at its own depth
+    // or above. Smaller cells on the other side find it instead, and cells
+    // of the same depth find each other, so the lower index links them.
+    std::vector<std::vector<Link>> cellLinks(m_cells.size());
+    for (uint32_t i = 0; i < m_cells.size(); ++i) {
+        const auto &cell = m_cells[i];
+        const auto gridSize = 1 << cell.depth;
+        const auto center = cellCenter(i);
+        for (int face = 0; face < 6; ++face) {
+            const auto axis = face / 2;
+            const auto step = face % 2 ? 1 : -1;
+            auto neighborPosition = cell.position;
+            neighborPosition[axis] += step;
+            if (neighborPosition[axis] < 0 || neighborPosition[axis] >= gridSize)
+                continue;
+            const auto neighbor = findCell(cell.depth, neighborPosition);
+            if (neighbor == NoCell || (m_cells[neighbor].depth == cell.depth && neighbor < i))
+                continue;
+
+            auto portal = center;
+            portal[axis] = step > 0 ? cell.box.max[axis] : cell.box.min[axis];
+            const auto cost = glm::length(cellCenter(neighbor) - center);
+            cellLinks[i].push_back({ neighbor, cost, portal });
+            cellLinks[neighbor].push_back({ i, cost, portal });
+        }
+    }
+
+    m_linkOffsets.clear();
+    m_linkOffsets.push_back(0);
+    for (const auto &links : cellLinks) {
+        m_links.insert(m_links.end(), links.begin(), links.end());
+        m_linkOffsets.push_back(m_links.size());
+    }
+}
+
+PathPlanner::PathPlanner(const NavGraph *graph, std::size_t maxGoals)
+    : m_graph(graph)
+    , m_maxGoals(std::max<std::size_t>(maxGoals, 1))
+{
+}
+
+void PathPlanner::clear()
+{
+    m_searches.clear();
+}
+
+bool PathPlanner::findPath(const glm::vec3 &from, const glm::vec3 &to, std::vector<glm::vec3> &path)
+{
+    path.clear();
+    ++m_stats.queryCount;
+
+    const auto start = m_graph->findCell(from);
+    const auto goal = m_graph->findCell(to);
+    if (start == NavGraph::NoCell || goal == NavGraph::NoCell)
+        return false;
+
+    auto &search = this->search(goal);
+    if (!search.closed[start] && !expand(search, start))
+        return false;
+
+    path.push_back(from);
+    for (auto cell = start; cell != goal; cell = search.next[cell])
+        path.push_back(m_graph->link(search.nextLink[cell]).portal);
+    path.push_back(to);
+    return true;
+}
+
+PathPlanner::Search &PathPlanner::search(uint32_t goal)
+{
+    ++m_useCount;
+    const auto it = std::find_if(m_searches.begin(), m_searches.end(), [goal](const Search &search) { return search.goal == goal; });
+    if (it != m_searches.end()) {
+        it->lastUse = m_useCount;
+        return *it;
+    }
+
+    // replace the least recently used search once there are enough
+    Search *search;
+    if (m_searches.size() < m_maxGoals) {
+        search = &m_searches.emplace_back();
+    } else {
+        search = &*std::min_element(m_searches.begin(), m_searches.end(), [](const Search &a, const Search &b) { return a.lastUse < b.lastUse; });
+    }
+
+    const auto cellCount = m_graph->cellCount();
+    search->goal = goal;
+    search->target = NavGraph::NoCell;
+    search->lastUse = m_useCount;
+    search->cost.assign(cellCount, std::numeric_limits<float>::max());
+    search->next.assign(cellCount, NavGraph::NoCell);
+    search->nextLink.assign(cellCount, 0);
+    search->closed.assign(cellCount, false);
+    search->open.clear();
+    search->cost[goal] = 0.0f;
+    search->open.emplace_back(0.0f, goal);
+    return *search;
+}
+
+bool PathPlanner::expand(Search &search, uint32_t start)
+{
+    ++m_stats.searchCount;
+
+    // A* towards the start. The distance between cell centers is consistent
+    // with the link costs, so the cells already closed have their final cost
+    // whichever start they were expanded for, and only the open cells need
+    // new estimates when the start changes.
+    const auto targetCenter = m_graph->cellCenter(start);
+    const auto estimate = [this, &search, &targetCenter](uint32_t cell) {
+        return search.cost[cell] + glm::length(m_graph->cellCenter(cell) - targetCenter);
+    };
+    if (search.target != start) {
+        search.open.erase(std::remove_if(search.open.begin(), search.open.end(), [&search](const auto &entry) { return search.closed[entry.second]; }), search.open.end());
+        for (auto &entry : search.open)
+            entry.first = estimate(entry.second);
+        std::make_heap(search.open.begin(), search.open.end(), std::greater<>());
+        search.target = start;
+    }
+
+    while (!search.open.empty()) {
+        std::pop_heap(search.open.begin(), search.open.end(), std::greater<>());
+        const auto cell = search.open.back().second;
+        search.open.pop_back();
+        if (search.closed[cell])
+            continue;
+        search.closed[cell] = true;
+        ++m_stats.cellsExpanded;
+
+        const auto [first, last] = m_graph->links(cell);
+        for (auto i = first; i < last; ++i) {
+            const auto &link = m_graph->link(i);
+            if (search.closed[link.cell])
+                continue;
+            const auto cost = search.cost[cell] + link.cost;
+            if (cost < search.cost[link.cell]) {
+                search.cost[link.cell] = cost;
+                search.next[link.cell] = cell;
+                search.nextLink[link.cell] = i;
+                search.open.emplace_back(estimate(link.cell), link.cell);
+                std::push_heap(search.open.begin(), search.open.end(), std::greater<>());
+            }
+        }
+
+        if (cell == start)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "geometryutils.h"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+class Level;
+
+// Graph of the empty space of a level, for ships flying around it. The level
+// box is subdivided like an octree until cells are at least clearance away
+// from the level geometry. The smallest cells, no smaller than minCellSize,
+// are kept if their center is clear. Cells are linked through the faces they share; the
+// portal of a link is the center of the smaller of the two faces.
+class NavGraph
+{
+public:
+    static constexpr uint32_t NoCell = ~0u;
+
+    struct Link {
+        uint32_t cell;
+        float cost; // distance between the cell centers
+        glm::vec3 portal;
+    };
+
+    // minCellSize should be at most the clearance, so that moving straight
+    // between neighboring cells doesn't cross the geometry.
+    void initialize(const Level &level, float clearance, float minCellSize);
+
+    float clearance() const { return m_clearance; }
+    std::size_t cellCount() const { return m_cells.size(); }
+    std::size_t linkCount() const { return m_links.size(); }
+    const BoundingBox &cellBox(uint32_t cell) const { return m_cells[cell].box; }
+    glm::vec3 cellCenter(uint32_t cell) const { return 0.5f * (m_cells[cell].box.min + m_cells[cell].box.max); }
+    // Links of the cell, as [first, last) indices for link().
+    std::pair<uint32_t, uint32_t> links(uint32_t cell) const { return { m_linkOffsets[cell], m_linkOffsets[cell + 1] }; }
+    const Link &link(uint32_t index) const { return m_links[index]; }
+
+    // Cell containing the point, or if it's in blocked space, the closest
+    // cell around it. NoCell if there's none.
+    uint32_t findCell(const glm::vec3 &point) const;
+
+private:
+    struct Cell {
+        BoundingBox box;
+        int depth;
+        glm::ivec3 position; // in cells of that depth
+    };
+
+    static uint64_t cellKey(int depth, const glm::ivec3 &position);
+    uint32_t findCell(int depth, const glm::ivec3 &position) const;
+    void initializeCell(const Level &level, int depth, const glm::ivec3 &position);
+    BoundingBox cellBox(int depth, const glm::ivec3 &position) const;
+    void linkCells();
+
+    BoundingBox m_boundingBox;
+    float m_clearance = 0.0f;
+    float m_minCellSize = 0.0f;
+    int m_maxDepth = 0;
+    std::vector<Cell> m_cells;
+    std::unordered_map<uint64_t, uint32_t> m_cellIndices; // by key
+    std::vector<uint32_t> m_linkOffsets;
+    std::vector<Link> m_links;
+};
+
+// Finds paths over a NavGraph. Searches run backwards from the goal and are
+// kept for the last few goals: foes chasing the same target share the
+// search, which is resumed only when a path starts from a cell it hasn't
+// reached yet.
+class PathPlanner
+{
+public:
+    explicit PathPlanner(const NavGraph *graph, std::size_t maxGoals = 8);
+
+    struct Stats {
+        std::size_t queryCount = 0;
+        std::size_t searchCount = 0; // queries that had to expand cells
+        std::size_t cellsExpanded = 0;
+    };
+
+    // Waypoints from `from` to `to`, both included, through the portals of
+    // the cells in between. False if either end isn't in the graph or they
+    // aren't connected.
+    bool findPath(const glm::vec3 &from, const glm::vec3 &to, std::vector<glm::vec3> &path);
+
+    const Stats &stats() const { return m_stats; }
+    void clear();
+
+private:
+    struct Search {
+        uint32_t goal;
+        uint32_t target; // start cell the open list is prioritized for
+        uint64_t lastUse;
+        std::vector<float> cost; // to the goal
+        std::vector<uint32_t> next; // towards the goal
+        std::vector<uint32_t> nextLink; // link to the next cell, for its portal
+        std::vector<bool> closed;
+        std::vector<std::pair<float, uint32_t>> open; // min-heap on the estimated path cost
+    };
+
+    Search &search(uint32_t goal);
+    bool expand(Search &search, uint32_t start);
+
+    const NavGraph *m_graph;
+    std::size_t m_maxGoals;
+    uint64_t m_useCount = 0;
+    std::vector<Search> m_searches;
+    Stats m_stats;
+};
@@ -1,5 +1,6 @@
 #include "octree.h"
 
+#include "datastream.h"
 #include "geometryutils.h"
 #include "material.h"
 #include "mesh.h"
@@ -10,14 +11,27 @@
 #include <glm/gtx/string_cast.hpp>
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <future>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <numeric>
+#include <random>
 #include <set>
+#include <thread>
 #include <unordered_map>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
 
-#define DRAW_NODE_BOXES 0
 #define DRAW_POLYGON_EDGES 0
-#define DEBUG_INTERSECTIONS 0
 
 namespace {
 const bool fuzzyCompare(float a, float b)
@@ -52,36 +66,27 @@ struct Plane {
     glm::vec3 normal;
 };
 
-struct Node {
-    virtual ~Node() = default;
-    BoundingBox boundingBox;
-#if DRAW_NODE_BOXES
-    std::unique_ptr<Mesh> boxMesh;
-#endif
-    virtual void render(Renderer *renderer, const glm::mat4 &worldMatrix) const = 0;
-
-    void findCollision(const LineSegment &segment, const glm::vec3 &tMin, const glm::vec3 &tMax, std::optional<float> &collisionT) const;
-    virtual void findLeafCollision(const LineSegment &segment, const glm::vec3 &tMin, const glm::vec3 &tMax, std::optional<float> &collisionT) const = 0;
-#if DEBUG_INTERSECTIONS
-    mutable bool m_intersected = false;
-#endif
+// CPU-side mesh data, built on worker threads or read from a baked octree and
+// uploaded by Octree::createMeshes
+struct MeshData {
+    GLenum primitive;
+    const Material *material;
+    std::vector<MeshVertex> vertices;
+    std::vector<unsigned> indices;
+    uint32_t leaf = std::numeric_limits<uint32_t>::max(); // whose faces these are, if any
 };
 
-struct LeafNode : Node {
-    void render(Renderer *renderer, const glm::mat4 &worldMatrix) const override;
-    void findLeafCollision(const LineSegment &segment, const glm::vec3 &tMin, const glm::vec3 &tMax, std::optional<float> &collisionT) const override;
-    struct MeshMaterial {
-        std::unique_ptr<Mesh> mesh;
-        const Material *material;
-    };
-    std::vector<MeshMaterial> meshes;
-    std::vector<Triangle> triangles;
-};
+struct BuildNode {
+    BoundingBox boundingBox;
+    std::vector<MeshData> meshes;
+    std::vector<uint32_t> triangles; // indices into the unclipped triangles
+    std::vector<Triangle> clippedTriangles;
+    std::array<std::unique_ptr<BuildNode>, 8> children;
 
-struct InternalNode : Node {
-    void render(Renderer *renderer, const glm::mat4 &worldMatrix) const override;
-    void findLeafCollision(const LineSegment &segment, const glm::vec3 &tMin, const glm::vec3 &tMax, std::optional<float> &collisionT) const override;
-    std::array<std::unique_ptr<Node>, 8> children;
+    bool isLeaf() const
+    {
+        return std::none_of(children.begin(), children.end(), [](const auto &child) { return child != nullptr; });
+    }
 };
 
 auto split(const Face &face, const Plane &plane)
@@ -118,7 +123,58 @@ auto split(const Face &face, const Plane &plane)
     return std::pair(frontFace, backFace);
 }
 
-std::unique_ptr<Node> initializeNode(const BoundingBox &box, const std::vector<Face> &faces);
+// Faces are always clipped to the nodes for rendering. With referenced
+// triangle storage, each node also gets the indices of the unclipped
+// triangles that overlap it.
+struct BuildContext {
+    const Octree::BuildParams &params;
+    const std::vector<Triangle> &triangles;
+};
+
+std::size_t collisionTriangleCount(const std::vector<Face> &faces, const std::vector<uint32_t> &triangles, const BuildContext &context)
+{
+    if (context.params.storage == Octree::TriangleStorage::Referenced)
+        return triangles.size();
+    return std::accumulate(faces.begin(), faces.end(), std::size_t(0), [](std::size_t count, const Face &face) {
+        return count + face.vertices.size() - 2;
+    });
+}
+
+std::unique_ptr<BuildNode> initializeNode(const BoundingBox &box, const std::vector<Face> &faces, const std::vector<uint32_t> &triangles, const BuildContext &context, int depth);
+
+BoundingBox childBox(const BoundingBox &box, int octant)
+{
+    const auto center = 0.5f * (box.min + box.max);
+    BoundingBox childBox;
+    for (int axis = 0; axis < 3; ++axis) {
+        if ((octant & (1 << axis)) == 0) {
+            childBox.min[axis] = box.min[axis];
+            childBox.max[axis] = center[axis];
+        } else {
+            childBox.min[axis] = center[axis];
+            childBox.max[axis] = box.max[axis];
+        }
+    }
+    return childBox;
+}
+
+// Triangles are referenced from the children of a node whose boxes, grown by
+// a small margin, they overlap. The margin keeps triangles lying on or
+// grazing a boundary in both children despite rounding, so that rays hitting
+// them along the boundary always find them.
+BoundingBox overlapTestBox(const BoundingBox &box, const BoundingBox &childBox)
+{
+    const auto margin = 1e-4f * (box.max - box.min);
+    return BoundingBox { childBox.min - margin, childBox.max + margin };
+}
+
+// surface area heuristic: a random ray through a box goes through a box inside
+// it with a probability given by the ratio of their areas
+float surfaceArea(const BoundingBox &box)
+{
+    const auto size = box.max - box.min;
+    return size.x * size.y + size.y * size.z + size.z * size.x;
+}
 
 struct VertexHasher {
     std::size_t operator()(const MeshVertex &vertex) const
@@ -147,10 +203,10 @@ struct VertexHasher {
     }
 };
 
-std::unique_ptr<Node> initializeLeafNode(const BoundingBox &box, const std::vector<Face> &faces)
+// one mesh for each material used by the faces
+std::vector<MeshData> faceMeshes(const std::vector<Face> &faces)
 {
-    auto node = std::make_unique<LeafNode>();
-    node->boundingBox = box;
+    std::vector<MeshData> meshes;
 
     std::set<const Material *> materials;
     std::transform(faces.begin(), faces.end(), std::inserter(materials, materials.begin()),
@@ -182,18 +238,16 @@ std::unique_ptr<Node> initializeLeafNode(const BoundingBox &box, const std::vect
         std::vector<unsigned> edgeIndices;
 #endif
         for (auto &face : faces) {
-            const auto &vertices = face.vertices;
-            for (int i = 1; i < vertices.size() - 1; ++i) {
-                const auto &v0 = vertices[0];
-                const auto &v1 = vertices[i];
-                const auto &v2 = vertices[i + 1];
-                node->triangles.push_back({ v0.position, v1.position, v2.position });
+            // faces removed by updates are left empty
+            if (face.material != material || face.vertices.empty()) {
+                continue;
             }
+            const auto &vertices = face.vertices;
             std::vector<unsigned> faceIndices;
             faceIndices.reserve(vertices.size());
             std::transform(vertices.begin(), vertices.end(), std::back_inserter(faceIndices),
                            [toMeshVertex, &vertexIndex](const Face::Vertex &faceVertex) {
-                               return vertexIndex[toMeshVertex(faceVertex)];
+                               return vertexIndex.at(toMeshVertex(faceVertex));
                            });
             for (int i = 1; i < faceIndices.size() - 1; ++i) {
                 indices.push_back(faceIndices[0]);
@@ -208,21 +262,54 @@ std::unique_ptr<Node> initializeLeafNode(const BoundingBox &box, const std::vect
 #endif
         }
 
-        auto mesh = makeMesh(GL_TRIANGLES, vertices, indices);
-        node->meshes.push_back({ std::move(mesh), material });
-
 #if DRAW_POLYGON_EDGES
-        auto edgeMesh = makeMesh(GL_LINES, vertices, edgeIndices);
-        node->meshes.push_back({ std::move(edgeMesh), debugMaterial() });
+        meshes.push_back({ GL_LINES, debugMaterial(), vertices, std::move(edgeIndices) });
 #endif
+        meshes.push_back({ GL_TRIANGLES, material, std::move(vertices), std::move(indices) });
+    }
+
+    return meshes;
+}
+
+// face of each of the triangles triangulate() makes
+std::vector<uint32_t> triangleFaces(const std::vector<Face> &faces)
+{
+    std::vector<uint32_t> triangleFaces;
+    for (std::size_t i = 0; i < faces.size(); ++i) {
+        const auto triangleCount = std::max<int>(faces[i].vertices.size(), 2) - 2;
+        triangleFaces.insert(triangleFaces.end(), triangleCount, i);
     }
+    return triangleFaces;
+}
 
+std::unique_ptr<BuildNode> initializeLeafNode(const BoundingBox &box, const std::vector<Face> &faces, const std::vector<uint32_t> &triangles, const BuildContext &context)
+{
+    auto node = std::make_unique<BuildNode>();
+    node->boundingBox = box;
+    if (context.params.storage == Octree::TriangleStorage::Clipped)
+        node->clippedTriangles = triangulate(faces);
+    else
+        node->triangles = triangles;
+    node->meshes = faceMeshes(faces);
     return node;
 }
 
-std::unique_ptr<Node> initializeInternalNode(const BoundingBox &box, const std::vector<Face> &faces)
+// Subtrees above this depth are built as separate tasks, deep enough to
+// give every core a few subtrees to work on.
+int parallelBuildDepth()
+{
+    const auto threadCount = std::max(1u, std::thread::hardware_concurrency());
+    if (threadCount == 1)
+        return 0;
+    int depth = 0;
+    for (auto taskCount = 1u; taskCount < 4 * threadCount; taskCount *= 8)
+        ++depth;
+    return depth;
+}
+
+std::unique_ptr<BuildNode> initializeInternalNode(const BoundingBox &box, const std::vector<Face> &faces, const std::vector<uint32_t> &triangles, const BuildContext &context, int depth)
 {
-    auto node = std::make_unique<InternalNode>();
+    auto node = std::make_unique<BuildNode>();
     node->boundingBox = box;
 
     for (auto &child : node->children) {
@@ -256,46 +343,63 @@ std::unique_ptr<Node> initializeInternalNode(const BoundingBox &box, const std::
         }
     }
 
+    std::array<BoundingBox, 8> childBoxes;
+    std::array<std::vector<uint32_t>, 8> childTriangles;
     for (int i = 0; i < 8; ++i) {
         if (childFaces[i].empty()) {
             continue;
         }
 
-        BoundingBox childBox;
+        const auto &childBox = childBoxes[i] = OctreePrivate::childBox(box, i);
+        const auto overlapBox = overlapTestBox(box, childBox);
+        std::copy_if(triangles.begin(), triangles.end(), std::back_inserter(childTriangles[i]), [&context, &overlapBox](uint32_t triangle) {
+            return context.triangles[triangle].intersects(overlapBox);
+        });
+    }
 
-        if ((i & 1) == 0) {
-            childBox.min.x = box.min.x;
-            childBox.max.x = center.x;
-        } else {
-            childBox.min.x = center.x;
-            childBox.max.x = box.max.x;
+    if (context.params.traversalCost > 0.0f) {
+        const auto nodeArea = surfaceArea(box);
+        if (nodeArea > 0.0f) {
+            auto splitCost = context.params.traversalCost;
+            for (int i = 0; i < 8; ++i) {
+                if (!childFaces[i].empty())
+                    splitCost += surfaceArea(childBoxes[i]) / nodeArea * collisionTriangleCount(childFaces[i], childTriangles[i], context);
+            }
+            if (splitCost >= collisionTriangleCount(faces, triangles, context))
+                return nullptr;
         }
+    }
 
-        if ((i & 2) == 0) {
-            childBox.min.y = box.min.y;
-            childBox.max.y = center.y;
-        } else {
-            childBox.min.y = center.y;
-            childBox.max.y = box.max.y;
+    static const auto ParallelBuildDepth = parallelBuildDepth();
+
+    std::array<std::future<std::unique_ptr<BuildNode>>, 8> childTasks;
+    for (int i = 0; i < 8; ++i) {
+        if (childFaces[i].empty()) {
+            continue;
         }
 
-        if ((i & 4) == 0) {
-            childBox.min.z = box.min.z;
-            childBox.max.z = center.z;
+        if (depth < ParallelBuildDepth) {
+            childTasks[i] = std::async(std::launch::async, [childBox = childBoxes[i], faces = std::move(childFaces[i]), triangles = std::move(childTriangles[i]), &context, depth] {
+                return initializeNode(childBox, faces, triangles, context, depth + 1);
+            });
         } else {
-            childBox.min.z = center.z;
-            childBox.max.z = box.max.z;
+            node->children[i] = initializeNode(childBoxes[i], childFaces[i], childTriangles[i], context, depth + 1);
         }
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        if (childTasks[i].valid())
+            node->children[i] = childTasks[i].get();
+    }
 
-        auto childNode = initializeNode(childBox, childFaces[i]);
-        assert(childNode);
-        node->children[i] = std::move(childNode);
+    for (int i = 0; i < 8; ++i) {
+        assert(childFaces[i].empty() || node->children[i]);
     }
 
     return node;
 }
 
-std::unique_ptr<Node> initializeNode(const BoundingBox &box, const std::vector<Face> &faces)
+std::unique_ptr<BuildNode> initializeNode(const BoundingBox &box, const std::vector<Face> &faces, const std::vector<uint32_t> &triangles, const BuildContext &context, int depth)
 {
     for (const auto &face : faces) {
         for (const auto &vertex : face.vertices) {
@@ -303,17 +407,225 @@ std::unique_ptr<Node> initializeNode(const BoundingBox &box, const std::vector<F
         }
     }
 
-    constexpr auto MaxFacesPerLeafNode = 20;
+    const auto &params = context.params;
 
-    std::unique_ptr<Node> node;
-    if (faces.size() <= MaxFacesPerLeafNode) {
-        node = initializeLeafNode(box, faces);
-    } else {
-        node = initializeInternalNode(box, faces);
+    std::unique_ptr<BuildNode> node;
+    if (faces.size() > params.maxFacesPerLeaf && depth < params.maxDepth)
+        node = initializeInternalNode(box, faces, triangles, context, depth);
+    // internal nodes give up when splitting isn't worth it
+    if (!node) {
+        node = initializeLeafNode(box, faces, triangles, context);
     }
     assert(node);
+    return node;
+}
+
+// Subtree an update builds in place of a leaf, or of a missing child that
+// added faces overlap. Its triangle indices are into triangles, the numbers
+// of the triangles in the octree, the added ones included.
+struct UpdateRegion {
+    uint32_t node; // the leaf, or the parent of the missing child
+    int octant; // of the missing child, -1 for leaves
+    std::unique_ptr<BuildNode> root;
+    std::vector<uint32_t> triangles;
+};
+
+// The part of the face in a node's box, clipped along the planes that split
+// its ancestors, which excludes the sides of the root box.
+Face clip(const Face &face, const BoundingBox &box, const BoundingBox &rootBox)
+{
+    auto clipped = face;
+    for (int axis = 0; axis < 3 && !clipped.vertices.empty(); ++axis) {
+        auto normal = glm::vec3(0.0f);
+        normal[axis] = 1.0f;
+        if (box.min[axis] > rootBox.min[axis])
+            clipped = split(clipped, Plane { box.min, normal }).second;
+        if (box.max[axis] < rootBox.max[axis] && !clipped.vertices.empty())
+            clipped = split(clipped, Plane { box.max, normal }).first;
+    }
+    return clipped;
+}
+
+// Bottom-up build for large levels: the triangles are sorted by the Morton
+// code of their centroids, so that the triangles whose centroids are in any
+// node are a range of the sorted array, and nodes are split until their range
+// is small enough. The triangles are then referenced from the leaves they
+// overlap. Nothing is clipped or copied per node along the way.
+namespace Morton {
+
+// bits per axis, the depth of Morton builds is limited to this
+constexpr int Bits = 21;
+
+struct Key {
+    uint64_t code;
+    uint32_t triangle;
+};
+
+// spreads the low 21 bits of v so that there are two zero bits between each
+uint64_t expandBits(uint32_t v)
+{
+    uint64_t x = v & 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+// Cells are numbered like octants, x in the lowest bit, so that the three
+// bits of the code for each depth are the octant of the cell in its parent.
+uint64_t code(const glm::vec3 &p, const BoundingBox &box)
+{
+    constexpr auto CellCount = 1u << Bits;
+    const auto size = box.max - box.min;
+    uint64_t code = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        const auto x = size[axis] > 0.0f ? (p[axis] - box.min[axis]) / size[axis] : 0.0f;
+        const auto cell = static_cast<uint32_t>(std::clamp(x * CellCount, 0.0f, static_cast<float>(CellCount - 1)));
+        code |= expandBits(cell) << axis;
+    }
+    return code;
+}
+
+int octant(uint64_t code, int depth)
+{
+    return (code >> (3 * (Bits - 1 - depth))) & 7;
+}
+
+// least significant digit first, a byte at a time
+void radixSort(std::vector<Key> &keys)
+{
+    std::vector<Key> sorted(keys.size());
+    for (int shift = 0; shift < 3 * Bits; shift += 8) {
+        std::array<std::size_t, 256> offsets {};
+        for (const auto &key : keys)
+            ++offsets[(key.code >> shift) & 0xff];
+        // nothing to do if all keys have the same digit
+        if (offsets[(keys.front().code >> shift) & 0xff] == keys.size())
+            continue;
+        std::size_t offset = 0;
+        for (auto &count : offsets)
+            offset += std::exchange(count, offset);
+        for (const auto &key : keys)
+            sorted[offsets[(key.code >> shift) & 0xff]++] = key;
+        keys.swap(sorted);
+    }
+}
+
+// Internal nodes have all of their eight children, at firstChild; those no
+// triangle overlaps are dropped when the tree is compacted.
+struct Node {
+    BoundingBox boundingBox;
+    int depth;
+    uint32_t begin, end; // range of sorted keys with their centroid in the node
+    uint32_t firstChild; // 0 for leaves
+    uint32_t firstReference; // leaves only
+    uint32_t referenceCount; // of the whole subtree
+    bool isLeaf() const { return firstChild == 0; }
+};
+
+std::vector<Node> buildNodes(const BoundingBox &box, const std::vector<Key> &keys, const Octree::BuildParams &params)
+{
+    const auto maxDepth = std::min(params.maxDepth, Bits);
+
+    std::vector<Node> nodes;
+    nodes.push_back({ box, 0, 0, static_cast<uint32_t>(keys.size()), 0, 0, 0 });
+    // children are appended after their parent, so this visits every node
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+        const auto node = nodes[i];
+        if (node.end - node.begin <= params.maxFacesPerLeaf || node.depth >= maxDepth)
+            continue;
+
+        std::array<uint32_t, 9> bounds;
+        bounds[0] = node.begin;
+        for (int octant = 0; octant < 8; ++octant) {
+            const auto it = std::partition_point(keys.begin() + bounds[octant], keys.begin() + node.end, [&node, octant](const Key &key) {
+                return Morton::octant(key.code, node.depth) <= octant;
+            });
+            bounds[octant + 1] = std::distance(keys.begin(), it);
+        }
+
+        std::array<BoundingBox, 8> childBoxes;
+        for (int octant = 0; octant < 8; ++octant)
+            childBoxes[octant] = childBox(node.boundingBox, octant);
+
+        // same as the top-down build, but the triangles in a node are only
+        // counted by their centroids
+        const auto nodeArea = surfaceArea(node.boundingBox);
+        if (params.traversalCost > 0.0f && nodeArea > 0.0f) {
+            auto splitCost = params.traversalCost;
+            for (int octant = 0; octant < 8; ++octant)
+                splitCost += surfaceArea(childBoxes[octant]) / nodeArea * (bounds[octant + 1] - bounds[octant]);
+            if (splitCost >= node.end - node.begin)
+                continue;
+        }
+
+        nodes[i].firstChild = nodes.size();
+        for (int octant = 0; octant < 8; ++octant)
+            nodes.push_back({ childBoxes[octant], node.depth + 1, bounds[octant], bounds[octant + 1], 0, 0, 0 });
+    }
+    return nodes;
+}
+
+struct Reference {
+    uint32_t leaf;
+    uint32_t triangle;
+};
+
+// leaves overlapping the triangles of the given keys, in the order of the keys
+std::vector<Reference> findReferences(const std::vector<Node> &nodes, const std::vector<Triangle> &triangles, const Key *begin, const Key *end)
+{
+    std::vector<Reference> references;
+    references.reserve(2 * (end - begin));
+    std::vector<uint32_t> stack;
+    for (auto key = begin; key != end; ++key) {
+        const auto &triangle = triangles[key->triangle];
+        const auto triangleBox = BoundingBox {} | triangle.v0 | triangle.v1 | triangle.v2;
+        stack.push_back(0);
+        while (!stack.empty()) {
+            const auto index = stack.back();
+            stack.pop_back();
+            const auto &node = nodes[index];
+            if (node.isLeaf()) {
+                references.push_back({ index, key->triangle });
+                continue;
+            }
+            // most triangles are only in one child, the others are rejected
+            // by which side of the center planes the triangle box is on
+            const auto &box = node.boundingBox;
+            const auto center = 0.5f * (box.min + box.max);
+            const auto margin = 1e-4f * (box.max - box.min);
+            int octantMask = 0xff;
+            for (int axis = 0; axis < 3; ++axis) {
+                static constexpr std::array<int, 3> LowOctants = { 0x55, 0x33, 0x0f };
+                if (triangleBox.min[axis] > center[axis] + margin[axis])
+                    octantMask &= ~LowOctants[axis];
+                if (triangleBox.max[axis] < center[axis] - margin[axis])
+                    octantMask &= LowOctants[axis];
+            }
+            for (int octant = 0; octant < 8; ++octant) {
+                if ((octantMask & (1 << octant)) == 0)
+                    continue;
+                const auto child = node.firstChild + octant;
+                const auto overlapBox = overlapTestBox(box, nodes[child].boundingBox);
+                if (!triangleBox.intersects(overlapBox))
+                    continue;
+                // no need for the full test if the triangle box is inside
+                const auto inside = overlapBox.contains(triangleBox.min) && overlapBox.contains(triangleBox.max);
+                if (inside || triangle.intersects(overlapBox))
+                    stack.push_back(child);
+            }
+        }
+    }
+    return references;
+}
+
+} // namespace Morton
 
 #if DRAW_NODE_BOXES
+MeshData boxMesh(const BoundingBox &box)
+{
     std::vector<MeshVertex> boxVerts(8);
     for (int i = 0; i < 8; ++i) {
         float x = ((i & 1) == 0) ? box.min.x : box.max.x;
@@ -335,165 +647,1545 @@ std::unique_ptr<Node> initializeNode(const BoundingBox &box, const std::vector<F
         2, 6,
         3, 7
     };
-    node->boxMesh = makeMesh(GL_LINES, boxVerts, boxIndices);
+    return { GL_LINES, debugMaterial(), std::move(boxVerts), std::move(boxIndices) };
+}
 #endif
 
-    return node;
+int childOffset(uint8_t childMask, int octant)
+{
+    return __builtin_popcount(childMask & ((1u << octant) - 1));
 }
 
-void Node::findCollision(const LineSegment &segment, const glm::vec3 &t0, const glm::vec3 &t1, std::optional<float> &collisionT) const
+// Slab tests of a ray against the eight children of a node at once. Along
+// each axis a child spans either [t0, tMid] or [tMid, t1] of the node's
+// parametric bounds, so the children's entry and exit distances are the max
+// and min of one of two values per axis. Returns the mask of the children the
+// ray enters within [0, tMax] and stores where it enters each of them.
+uint8_t childSlabTests(const glm::vec3 &t0, const glm::vec3 &tMid, const glm::vec3 &t1, float tMax, float tEnter[8])
 {
-#if DEBUG_INTERSECTIONS
-    {
-        const auto ray = segment.ray();
-        assertCompare(t0, (boundingBox.min - ray.origin) / ray.direction);
-        assertCompare(t1, (boundingBox.max - ray.origin) / ray.direction);
+    const auto lowerMin = glm::min(t0, tMid);
+    const auto lowerMax = glm::max(t0, tMid);
+    const auto upperMin = glm::min(tMid, t1);
+    const auto upperMax = glm::max(tMid, t1);
+
+#if HAVE_X86_KERNELS
+    // two passes over four children each, the lower and upper ones along z;
+    // SSE2 is part of the x86-64 baseline, so this inlines in the traversal
+    const auto xMin = _mm_setr_ps(lowerMin.x, upperMin.x, lowerMin.x, upperMin.x);
+    const auto xMax = _mm_setr_ps(lowerMax.x, upperMax.x, lowerMax.x, upperMax.x);
+    const auto yMin = _mm_setr_ps(lowerMin.y, lowerMin.y, upperMin.y, upperMin.y);
+    const auto yMax = _mm_setr_ps(lowerMax.y, lowerMax.y, upperMax.y, upperMax.y);
+    const auto xyEnter = _mm_max_ps(xMin, yMin);
+    const auto xyExit = _mm_min_ps(xMax, yMax);
+    const auto limit = _mm_set1_ps(tMax);
+    const auto zero = _mm_setzero_ps();
+
+    int mask = 0;
+    for (int half = 0; half < 2; ++half) {
+        const auto enter = _mm_max_ps(xyEnter, _mm_set1_ps(half ? upperMin.z : lowerMin.z));
+        const auto exit = _mm_min_ps(xyExit, _mm_set1_ps(half ? upperMax.z : lowerMax.z));
+        const auto hit = _mm_and_ps(_mm_and_ps(_mm_cmple_ps(enter, exit), _mm_cmple_ps(enter, limit)), _mm_cmpge_ps(exit, zero));
+        _mm_storeu_ps(tEnter + 4 * half, enter);
+        mask |= _mm_movemask_ps(hit) << (4 * half);
+    }
+    return mask;
+#else
+    uint8_t mask = 0;
+    for (int i = 0; i < 8; ++i) {
+        const auto enter = std::max(std::max((i & 1) ? upperMin.x : lowerMin.x, (i & 2) ? upperMin.y : lowerMin.y), (i & 4) ? upperMin.z : lowerMin.z);
+        const auto exit = std::min(std::min((i & 1) ? upperMax.x : lowerMax.x, (i & 2) ? upperMax.y : lowerMax.y), (i & 4) ? upperMax.z : lowerMax.z);
+        tEnter[i] = enter;
+        if (enter <= exit && enter <= tMax && exit >= 0.0f)
+            mask |= 1 << i;
     }
+    return mask;
 #endif
+}
 
-    const auto intersects = [&t0, &t1] {
-        const auto tMin = glm::min(t0, t1);
-        const auto tMax = glm::max(t0, t1);
-
-        const auto tClose = glm::compMax(tMin);
-        const auto tFar = glm::compMin(tMax);
+// Triangles referenced from several leaves would be tested once per leaf.
+// Queries remember the last triangles they tested in a small direct-mapped
+// table and skip them; a triangle evicted by another one is just tested again.
+struct Mailbox {
+    static constexpr auto Size = 32;
+    std::array<uint32_t, Size> triangles;
 
-        if (tClose > tFar)
-            return false;
+    Mailbox() { triangles.fill(std::numeric_limits<uint32_t>::max()); }
 
-        if (tClose > 1.0f || tFar < 0.0f)
+    // marks the triangle as tested, false if it was already
+    bool insert(uint32_t triangle)
+    {
+        auto &slot = triangles[triangle % Size];
+        if (slot == triangle)
             return false;
-
+        slot = triangle;
         return true;
-    }();
-#if DEBUG_INTERSECTIONS
-    m_intersected = intersects;
-#else
-    if (!intersects)
-        return;
-#endif
+    }
+};
 
-    findLeafCollision(segment, t0, t1, collisionT);
-}
+} // namespace OctreePrivate
 
-void LeafNode::findLeafCollision(const LineSegment &segment, const glm::vec3 &tMin, const glm::vec3 &tMax, std::optional<float> &collisionT) const
+std::vector<Triangle> triangulate(const std::vector<Face> &faces)
 {
-    for (const auto &triangle : triangles) {
-        if (const auto ot = segment.intersection(triangle)) {
-            const auto t = *ot;
-            if (!collisionT || t < *collisionT)
-                collisionT = t;
+    std::vector<Triangle> triangles;
+    for (const auto &face : faces) {
+        const auto &vertices = face.vertices;
+        for (int i = 1; i < static_cast<int>(vertices.size()) - 1; ++i) {
+            triangles.push_back({ vertices[0].position, vertices[i].position, vertices[i + 1].position });
         }
     }
+    return triangles;
 }
 
-void LeafNode::render(Renderer *renderer, const glm::mat4 &worldMatrix) const
+Octree::Octree() = default;
+Octree::~Octree() = default;
+
+void Octree::initialize(const std::vector<Face> &faces)
 {
-#if DRAW_NODE_BOXES
-#if DEBUG_INTERSECTIONS
-    if (m_intersected)
-#endif
-        renderer->render(boxMesh.get(), debugMaterial(), worldMatrix);
-#endif
-    for (auto &m : meshes) {
-        renderer->render(m.mesh.get(), m.material, worldMatrix);
-    }
+    initialize(faces, BuildParams());
 }
 
-void InternalNode::render(Renderer *renderer, const glm::mat4 &worldMatrix) const
+void Octree::initialize(const std::vector<Face> &faces, const BuildParams &params)
 {
+    std::vector<OctreePrivate::MeshData> meshes;
+    build(faces, params, meshes);
+    computeVisibility(meshes, params.visibilitySampleCount);
+    createMeshes(meshes);
+}
+
+void Octree::clear()
+{
+    m_boundingBox = {};
+    m_nodes.clear();
+    m_triangles.clear();
+    m_triangleIndices.clear();
+    m_triangleFaces.clear();
+    m_meshes.clear();
+    m_visibleMeshOffsets.clear();
+    m_visibleMeshes.clear();
 #if DRAW_NODE_BOXES
-#if DEBUG_INTERSECTIONS
-    if (m_intersected)
+    m_boxMeshes.clear();
 #endif
-        renderer->render(boxMesh.get(), debugMaterial(), worldMatrix);
-#endif
-    for (auto &child : children) {
-        if (child) {
-            child->render(renderer, worldMatrix);
+}
+
+void Octree::build(const std::vector<Face> &faces, const BuildParams &params, std::vector<OctreePrivate::MeshData> &meshes)
+{
+    clear();
+
+    if (faces.empty())
+        return;
+
+    BoundingBox box;
+    for (const auto &f : faces) {
+        for (auto &v : f.vertices) {
+            box |= v.position;
         }
     }
+
+    m_boundingBox = box;
+
+    if (params.method == BuildMethod::Morton) {
+        buildMorton(box, faces, params, meshes);
+        return;
+    }
+
+    const auto triangles = params.storage == TriangleStorage::Referenced ? triangulate(faces) : std::vector<Triangle>();
+    std::vector<uint32_t> triangleIndices(triangles.size());
+    std::iota(triangleIndices.begin(), triangleIndices.end(), 0);
+
+    const OctreePrivate::BuildContext context { params, triangles };
+    auto root = OctreePrivate::initializeNode(box, faces, triangleIndices, context, 0);
+
+    m_nodes.emplace_back();
+    compact(*root, 0, meshes);
+
+    if (params.storage == TriangleStorage::Referenced)
+        numberTriangles(triangles, OctreePrivate::triangleFaces(faces));
 }
 
-void InternalNode::findLeafCollision(const LineSegment &segment, const glm::vec3 &tMin, const glm::vec3 &tMax, std::optional<float> &collisionT) const
+void Octree::buildMorton(const BoundingBox &box, const std::vector<Face> &faces, const BuildParams &params, std::vector<OctreePrivate::MeshData> &meshes)
 {
-    const auto tMid = 0.5f * (tMin + tMax);
+    using namespace OctreePrivate;
 
-    for (int i = 0; i < 8; ++i) {
-        const auto &child = children[i];
-        if (!child)
-            continue;
+    const auto triangles = triangulate(faces);
+    if (triangles.empty())
+        return;
 
-        glm::vec3 childTMin, childTMax;
+    std::vector<Morton::Key> keys(triangles.size());
+    for (std::size_t i = 0; i < triangles.size(); ++i) {
+        const auto &triangle = triangles[i];
+        keys[i] = { Morton::code((triangle.v0 + triangle.v1 + triangle.v2) / 3.0f, box), static_cast<uint32_t>(i) };
+    }
+    Morton::radixSort(keys);
+
+    auto nodes = Morton::buildNodes(box, keys, params);
+
+    // Finding the leaves each triangle overlaps is most of the work, it's
+    // split between threads by ranges of keys. Sorting the references by leaf
+    // afterwards keeps the order of the keys within each leaf.
+    const auto threadCount = std::max(1u, std::thread::hardware_concurrency());
+    const auto keysPerTask = (keys.size() + threadCount - 1) / threadCount;
+    std::vector<std::future<std::vector<Morton::Reference>>> tasks;
+    for (std::size_t begin = 0; begin < keys.size(); begin += keysPerTask) {
+        const auto end = std::min(begin + keysPerTask, keys.size());
+        tasks.push_back(std::async(std::launch::async, [&nodes, &triangles, &keys, begin, end] {
+            return Morton::findReferences(nodes, triangles, keys.data() + begin, keys.data() + end);
+        }));
+    }
+    std::vector<std::vector<Morton::Reference>> taskReferences;
+    for (auto &task : tasks)
+        taskReferences.push_back(task.get());
 
-        if ((i & 1) == 0) {
-            childTMin.x = tMin.x;
-            childTMax.x = tMid.x;
-        } else {
-            childTMin.x = tMid.x;
-            childTMax.x = tMax.x;
+    for (const auto &references : taskReferences) {
+        for (const auto &reference : references)
+            ++nodes[reference.leaf].referenceCount;
+    }
+    uint32_t referenceCount = 0;
+    for (auto &node : nodes) {
+        if (node.isLeaf())
+            node.firstReference = std::exchange(referenceCount, referenceCount + node.referenceCount);
+    }
+    std::vector<uint32_t> leafTriangles(referenceCount);
+    {
+        std::vector<uint32_t> offsets(nodes.size());
+        std::transform(nodes.begin(), nodes.end(), offsets.begin(), [](const Morton::Node &node) { return node.firstReference; });
+        for (const auto &references : taskReferences) {
+            for (const auto &reference : references)
+                leafTriangles[offsets[reference.leaf]++] = reference.triangle;
         }
+    }
 
-        float childTyMin, childTyMax;
-        if ((i & 2) == 0) {
-            childTMin.y = tMin.y;
-            childTMax.y = tMid.y;
-        } else {
-            childTMin.y = tMid.y;
-            childTMax.y = tMax.y;
+    // children come after their parents
+    for (auto i = nodes.size(); i-- > 0;) {
+        auto &node = nodes[i];
+        if (!node.isLeaf()) {
+            for (auto child = node.firstChild; child < node.firstChild + 8; ++child)
+                node.referenceCount += nodes[child].referenceCount;
         }
+    }
 
-        float childTzMin, childTzMax;
-        if ((i & 4) == 0) {
-            childTMin.z = tMin.z;
-            childTMax.z = tMid.z;
+    m_nodes.emplace_back();
+    compact(nodes, leafTriangles, 0, 0);
+    numberTriangles(triangles, {});
+
+    // Faces aren't clipped to the leaves for rendering, they're grouped into
+    // meshes by chunks of their Morton order instead.
+    constexpr auto MaxMeshFaces = 4096;
+    const auto triangleFaces = OctreePrivate::triangleFaces(faces);
+    std::vector<bool> faceAdded(faces.size(), false);
+    std::vector<Face> meshFaces;
+    const auto addMeshes = [&meshes, &meshFaces] {
+        auto faceMeshes = OctreePrivate::faceMeshes(meshFaces);
+        std::move(faceMeshes.begin(), faceMeshes.end(), std::back_inserter(meshes));
+        meshFaces.clear();
+    };
+    for (const auto &key : keys) {
+        const auto face = triangleFaces[key.triangle];
+        if (faceAdded[face])
+            continue;
+        faceAdded[face] = true;
+        meshFaces.push_back(faces[face]);
+        if (meshFaces.size() == MaxMeshFaces)
+            addMeshes();
+    }
+    if (!meshFaces.empty())
+        addMeshes();
+}
+
+void Octree::numberTriangles(const std::vector<Triangle> &triangles, const std::vector<uint32_t> &triangleFaces)
+{
+    // number the triangles in the order the leaves first reference them
+    constexpr auto Unassigned = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> order(triangles.size(), Unassigned);
+    for (auto &node : m_nodes) {
+        if (!node.isLeaf())
+            continue;
+        const auto firstOwned = static_cast<uint32_t>(m_triangles.size());
+        const auto begin = m_triangleIndices.begin() + node.first;
+        const auto end = begin + node.triangleCount;
+        for (auto it = begin; it != end; ++it) {
+            if (order[*it] == Unassigned) {
+                order[*it] = m_triangles.size();
+                m_triangles.append(triangles[*it]);
+                if (!triangleFaces.empty())
+                    m_triangleFaces.push_back(triangleFaces[*it]);
+            }
+            *it = order[*it];
+        }
+        std::sort(begin, end);
+        const auto sharedTriangleCount = std::lower_bound(begin, end, firstOwned) - begin;
+        assert(sharedTriangleCount <= MaxSharedTriangleCount);
+        node.sharedTriangleCount = sharedTriangleCount;
+    }
+}
+
+void Octree::compact(OctreePrivate::BuildNode &buildNode, uint32_t nodeIndex, std::vector<OctreePrivate::MeshData> &meshes)
+{
+    {
+        auto &node = m_nodes[nodeIndex];
+        node.childMask = 0;
+        node.triangleCount = 0;
+        node.sharedTriangleCount = 0;
+    }
+
+    if (buildNode.isLeaf()) {
+        auto &node = m_nodes[nodeIndex];
+        node.first = m_triangleIndices.size();
+        if (!buildNode.clippedTriangles.empty()) {
+            // copies only this leaf uses, in blocks of their own
+            for (const auto &triangle : buildNode.clippedTriangles) {
+                m_triangleIndices.push_back(m_triangles.size());
+                m_triangles.append(triangle);
+            }
+            m_triangles.alignToBlock();
         } else {
-            childTMin.z = tMid.z;
-            childTMax.z = tMax.z;
+            m_triangleIndices.insert(m_triangleIndices.end(), buildNode.triangles.begin(), buildNode.triangles.end());
         }
+        node.triangleCount = m_triangleIndices.size() - node.first;
+        for (auto &mesh : buildNode.meshes)
+            mesh.leaf = nodeIndex;
+        std::move(buildNode.meshes.begin(), buildNode.meshes.end(), std::back_inserter(meshes));
+        return;
+    }
 
-        child->findCollision(segment, childTMin, childTMax, collisionT);
+    // allocate the children block first so that siblings end up contiguous
+    const auto first = static_cast<uint32_t>(m_nodes.size());
+    uint8_t childMask = 0;
+    for (int i = 0; i < 8; ++i) {
+        if (buildNode.children[i])
+            childMask |= 1 << i;
+    }
+    const auto childCount = OctreePrivate::childOffset(childMask, 8);
+    m_nodes.resize(m_nodes.size() + childCount);
+    m_nodes[nodeIndex].first = first;
+    m_nodes[nodeIndex].childMask = childMask;
+
+    auto childIndex = first;
+    for (auto &child : buildNode.children) {
+        if (child)
+            compact(*child, childIndex++, meshes);
     }
 }
 
-} // namespace OctreePrivate
+void Octree::compact(const std::vector<OctreePrivate::Morton::Node> &mortonNodes, const std::vector<uint32_t> &leafTriangles, uint32_t mortonIndex, uint32_t nodeIndex)
+{
+    const auto &mortonNode = mortonNodes[mortonIndex];
+    {
+        auto &node = m_nodes[nodeIndex];
+        node.childMask = 0;
+        node.triangleCount = 0;
+        node.sharedTriangleCount = 0;
+    }
 
-Octree::Octree() = default;
-Octree::~Octree() = default;
+    if (mortonNode.isLeaf()) {
+        auto &node = m_nodes[nodeIndex];
+        node.first = m_triangleIndices.size();
+        node.triangleCount = mortonNode.referenceCount;
+        const auto begin = leafTriangles.begin() + mortonNode.firstReference;
+        m_triangleIndices.insert(m_triangleIndices.end(), begin, begin + mortonNode.referenceCount);
+        return;
+    }
 
-void Octree::initialize(const std::vector<Face> &faces)
-{
-    BoundingBox box;
-    for (const auto &f : faces) {
-        for (auto &v : f.vertices) {
-            box |= v.position;
-        }
+    // children no triangle overlaps are dropped
+    const auto first = static_cast<uint32_t>(m_nodes.size());
+    uint8_t childMask = 0;
+    for (int i = 0; i < 8; ++i) {
+        if (mortonNodes[mortonNode.firstChild + i].referenceCount != 0)
+            childMask |= 1 << i;
+    }
+    const auto childCount = OctreePrivate::childOffset(childMask, 8);
+    m_nodes.resize(m_nodes.size() + childCount);
+    m_nodes[nodeIndex].first = first;
+    m_nodes[nodeIndex].childMask = childMask;
+
+    auto childIndex = first;
+    for (int i = 0; i < 8; ++i) {
+        if ((childMask & (1 << i)) != 0)
+            compact(mortonNodes, leafTriangles, mortonNode.firstChild + i, childIndex++);
     }
-    m_root = OctreePrivate::initializeNode(box, faces);
 }
 
-void Octree::render(Renderer *renderer, const glm::mat4 &worldMatrix) const
+void Octree::createMeshes(const std::vector<OctreePrivate::MeshData> &meshes)
 {
-    if (m_root) {
-        m_root->render(renderer, worldMatrix);
+    for (const auto &m : meshes) {
+        m_meshes.push_back({ makeMesh(m.primitive, m.vertices, m.indices), m.material, m.leaf });
+    }
+#if DRAW_NODE_BOXES
+    for (const auto &box : nodeBoxes()) {
+        const auto boxMesh = OctreePrivate::boxMesh(box);
+        m_boxMeshes.push_back(makeMesh(boxMesh.primitive, boxMesh.vertices, boxMesh.indices));
     }
+#endif
+#if DEBUG_INTERSECTIONS
+    m_nodeBoxes = nodeBoxes();
+    std::lock_guard lock(m_intersectedMutex);
+    m_intersected.assign(m_nodes.size(), false);
+#endif
 }
 
-std::optional<glm::vec3> Octree::findCollision(const LineSegment &segment) const
+std::vector<BoundingBox> Octree::nodeBoxes() const
 {
-    if (!m_root)
-        return {};
+    std::vector<BoundingBox> boxes(m_nodes.size());
+    if (m_nodes.empty())
+        return boxes;
+    // children come after their parent, but updates can move nodes after
+    // their children
+    boxes.front() = m_boundingBox;
+    std::vector<uint32_t> stack { 0 };
+    while (!stack.empty()) {
+        const auto nodeIndex = stack.back();
+        stack.pop_back();
+        const auto &node = m_nodes[nodeIndex];
+        for (int octant = 0; octant < 8; ++octant) {
+            if ((node.childMask & (1 << octant)) != 0) {
+                const auto child = node.first + OctreePrivate::childOffset(node.childMask, octant);
+                boxes[child] = OctreePrivate::childBox(boxes[nodeIndex], octant);
+                stack.push_back(child);
+            }
+        }
+    }
+    return boxes;
+}
 
-    const auto &bb = m_root->boundingBox;
+uint32_t Octree::findNode(const glm::vec3 &point) const
+{
+    if (m_nodes.empty())
+        return NoNode;
+    auto box = m_boundingBox;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (point[axis] < box.min[axis] || point[axis] > box.max[axis])
+            return NoNode;
+    }
 
-    // TODO handle ray parallel to bounding box faces
-    const auto ray = segment.ray();
-    const auto tMin = (bb.min - ray.origin) / ray.direction;
-    const auto tMax = (bb.max - ray.origin) / ray.direction;
+    uint32_t nodeIndex = 0;
+    for (;;) {
+        const auto &node = m_nodes[nodeIndex];
+        if (node.isLeaf())
+            return nodeIndex;
+        const auto center = 0.5f * (box.min + box.max);
+        const auto octant = (point.x > center.x ? 1 : 0) | (point.y > center.y ? 2 : 0) | (point.z > center.z ? 4 : 0);
+        if ((node.childMask & (1 << octant)) == 0)
+            return nodeIndex;
+        box = OctreePrivate::childBox(box, octant);
+        nodeIndex = node.first + OctreePrivate::childOffset(node.childMask, octant);
+    }
+}
 
+// same overlap test as the one used to reference triangles from the leaves
+template<typename F>
+void Octree::forEachLeaf(const Triangle &triangle, F &&f) const
+{
+    forEachCell(triangle, [&f](uint32_t nodeIndex, int octant, const BoundingBox &, int) {
+        if (octant < 0)
+            f(nodeIndex);
+    });
+}
+
+template<typename F>
+void Octree::forEachCell(const Triangle &triangle, F &&f) const
+{
+    if (m_nodes.empty())
+        return;
+    const auto triangleBox = BoundingBox {} | triangle.v0 | triangle.v1 | triangle.v2;
+    struct Entry {
+        uint32_t nodeIndex;
+        BoundingBox box;
+        int depth;
+    };
+    std::vector<Entry> stack { { 0, m_boundingBox, 0 } };
+    while (!stack.empty()) {
+        const auto [nodeIndex, box, depth] = stack.back();
+        stack.pop_back();
+        const auto &node = m_nodes[nodeIndex];
+        if (node.isLeaf()) {
+            f(nodeIndex, -1, box, depth);
+            continue;
+        }
+        for (int i = 0; i < 8; ++i) {
+            const auto childBox = OctreePrivate::childBox(box, i);
+            const auto overlapBox = OctreePrivate::overlapTestBox(box, childBox);
+            if (!triangleBox.intersects(overlapBox) || !triangle.intersects(overlapBox))
+                continue;
+            if ((node.childMask & (1 << i)) != 0)
+                stack.push_back({ node.first + OctreePrivate::childOffset(node.childMask, i), childBox, depth + 1 });
+            else
+                f(nodeIndex, i, childBox, depth + 1);
+        }
+    }
+}
+
+// Ray sampled potentially visible sets. Rays are cast in random directions
+// from random points of each cell where the viewpoint can be: the leaves, and
+// the missing children of internal nodes. Whatever meshes overlap the leaf
+// each ray hits are visible from the cell. Objects blocking the view are
+// found by sampling, so very small gaps can be missed.
+void Octree::computeVisibility(const std::vector<OctreePrivate::MeshData> &meshes, int sampleCount)
+{
+    m_visibleMeshOffsets.clear();
+    m_visibleMeshes.clear();
+    if (m_nodes.empty() || sampleCount <= 0)
+        return;
+
+    std::vector<std::vector<uint32_t>> leafMeshes(m_nodes.size());
+    for (std::size_t i = 0; i < meshes.size(); ++i) {
+        const auto &mesh = meshes[i];
+        const auto &vertices = mesh.vertices;
+        const auto &indices = mesh.indices;
+        const std::size_t stride = mesh.primitive == GL_LINES ? 2 : 3;
+        for (std::size_t j = 0; j + stride <= indices.size(); j += stride) {
+            const Triangle triangle { vertices[indices[j]].position, vertices[indices[j + 1]].position, vertices[indices[j + stride - 1]].position };
+            forEachLeaf(triangle, [&leafMeshes, i](uint32_t leaf) {
+                auto &meshes = leafMeshes[leaf];
+                if (meshes.empty() || meshes.back() != i)
+                    meshes.push_back(i);
+            });
+        }
+    }
+
+    const auto boxes = nodeBoxes();
+    const auto rayLength = glm::length(m_boundingBox.max - m_boundingBox.min);
+
+    // Cells are split between threads. Each cell has its own random numbers,
+    // so the sets don't depend on the number of threads.
+    const auto visibleMeshes = [&](uint32_t nodeIndex) {
+        const auto &node = m_nodes[nodeIndex];
+        std::vector<uint8_t> visible(meshes.size(), false);
+        if (node.isLeaf()) {
+            for (const auto mesh : leafMeshes[nodeIndex])
+                visible[mesh] = true;
+        }
+
+        std::array<int, 8> missingChildren;
+        int missingChildCount = 0;
+        for (int i = 0; i < 8; ++i) {
+            if ((node.childMask & (1 << i)) == 0)
+                missingChildren[missingChildCount++] = i;
+        }
+
+        std::mt19937 rng(nodeIndex);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        std::normal_distribution<float> normal;
+        for (int sample = 0; sample < sampleCount; ++sample) {
+            auto box = boxes[nodeIndex];
+            if (!node.isLeaf())
+                box = OctreePrivate::childBox(box, missingChildren[sample % missingChildCount]);
+            const auto origin = box.min + glm::vec3(unit(rng), unit(rng), unit(rng)) * (box.max - box.min);
+            const auto direction = glm::normalize(glm::vec3(normal(rng), normal(rng), normal(rng)) + glm::vec3(1e-6f));
+            const auto hit = findCollision(LineSegment { origin, origin + rayLength * direction });
+            if (!hit)
+                continue;
+            const auto leaf = findNode(*hit);
+            if (leaf != NoNode && m_nodes[leaf].isLeaf()) {
+                for (const auto mesh : leafMeshes[leaf])
+                    visible[mesh] = true;
+            }
+        }
+
+        std::vector<uint32_t> meshIndices;
+        for (std::size_t i = 0; i < visible.size(); ++i) {
+            if (visible[i])
+                meshIndices.push_back(i);
+        }
+        return meshIndices;
+    };
+
+    std::vector<std::vector<uint32_t>> cellMeshes(m_nodes.size());
+    const auto threadCount = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::future<void>> tasks;
+    for (unsigned thread = 0; thread < threadCount; ++thread) {
+        tasks.push_back(std::async(std::launch::async, [this, &cellMeshes, &visibleMeshes, thread, threadCount] {
+            for (auto i = thread; i < m_nodes.size(); i += threadCount) {
+                if (m_nodes[i].childMask != 0xff)
+                    cellMeshes[i] = visibleMeshes(i);
+            }
+        }));
+    }
+    for (auto &task : tasks)
+        task.get();
+
+    m_visibleMeshOffsets.push_back(0);
+    for (const auto &meshIndices : cellMeshes) {
+        m_visibleMeshes.insert(m_visibleMeshes.end(), meshIndices.begin(), meshIndices.end());
+        m_visibleMeshOffsets.push_back(m_visibleMeshes.size());
+    }
+}
+
+Octree::Update::Update() = default;
+Octree::Update::~Update() = default;
+
+bool Octree::isUpdatable() const
+{
+    return !m_nodes.empty() && !m_triangleFaces.empty();
+}
+
+std::unique_ptr<Octree::Update> Octree::prepareUpdate(const std::vector<Face> &faces, const std::vector<uint32_t> &removedFaces, const std::vector<Face> &addedFaces, const BuildParams &params) const
+{
+    using namespace OctreePrivate;
+
+    if (!isUpdatable())
+        return nullptr;
+    for (const auto &face : addedFaces) {
+        for (const auto &vertex : face.vertices) {
+            if (!m_boundingBox.contains(vertex.position))
+                return nullptr;
+        }
+    }
+
+    auto update = std::make_unique<Update>();
+
+    std::vector<bool> removed(faces.size(), false);
+    for (const auto face : removedFaces) {
+        if (face < removed.size())
+            removed[face] = true;
+    }
+    const auto isRemoved = [this, &removed](uint32_t triangle) {
+        const auto face = m_triangleFaces[triangle];
+        return face == NoFace || (face < removed.size() && removed[face]);
+    };
+    for (uint32_t i = 0; i < m_triangleFaces.size(); ++i) {
+        if (m_triangleFaces[i] != NoFace && isRemoved(i))
+            update->m_removedTriangles.push_back(i);
+    }
+
+    // Cells to rebuild, leaves first, with the added triangles and faces
+    // that overlap them.
+    struct Cell {
+        BoundingBox box;
+        int depth;
+        std::vector<uint32_t> addedTriangles;
+        std::vector<uint32_t> addedFaces;
+    };
+    std::map<std::pair<int, uint32_t>, Cell> cells;
+
+    // every leaf referencing a removed triangle, not only the ones a
+    // traversal finds, so that none of them is left referenced
+    if (!update->m_removedTriangles.empty()) {
+        struct Entry {
+            uint32_t nodeIndex;
+            BoundingBox box;
+            int depth;
+        };
+        std::vector<Entry> stack { { 0, m_boundingBox, 0 } };
+        while (!stack.empty()) {
+            const auto [nodeIndex, box, depth] = stack.back();
+            stack.pop_back();
+            const auto &node = m_nodes[nodeIndex];
+            if (node.isLeaf()) {
+                const auto begin = m_triangleIndices.begin() + node.first;
+                const auto end = begin + node.triangleCount;
+                if (std::any_of(begin, end, isRemoved))
+                    cells[{ -1, nodeIndex }] = { box, depth, {}, {} };
+                continue;
+            }
+            for (int i = 0; i < 8; ++i) {
+                if ((node.childMask & (1 << i)) != 0)
+                    stack.push_back({ node.first + childOffset(node.childMask, i), childBox(box, i), depth + 1 });
+            }
+        }
+    }
+
+    for (std::size_t i = 0; i < addedFaces.size(); ++i) {
+        const auto &vertices = addedFaces[i].vertices;
+        for (int j = 1; j < static_cast<int>(vertices.size()) - 1; ++j) {
+            const auto triangleIndex = static_cast<uint32_t>(update->m_addedTriangles.size());
+            const Triangle triangle { vertices[0].position, vertices[j].position, vertices[j + 1].position };
+            update->m_addedTriangles.push_back(triangle);
+            update->m_addedTriangleFaces.push_back(faces.size() + i);
+            forEachCell(triangle, [&cells, triangleIndex, i](uint32_t nodeIndex, int octant, const BoundingBox &box, int depth) {
+                auto &cell = cells[{ octant, nodeIndex }];
+                cell.box = box;
+                cell.depth = depth;
+                cell.addedTriangles.push_back(triangleIndex);
+                if (cell.addedFaces.empty() || cell.addedFaces.back() != i)
+                    cell.addedFaces.push_back(i);
+            });
+        }
+    }
+
+    // the subtrees are built like the rest of the tree was
+    auto leafParams = params;
+    leafParams.method = BuildMethod::TopDown;
+    leafParams.storage = TriangleStorage::Referenced;
+
+    for (auto &[key, cell] : cells) {
+        const auto [octant, nodeIndex] = key;
+        std::vector<Triangle> triangles;
+        std::vector<uint32_t> triangleNumbers;
+        std::vector<uint32_t> faceIndices;
+        if (octant < 0) {
+            const auto &node = m_nodes[nodeIndex];
+            for (auto i = node.first; i < node.first + node.triangleCount; ++i) {
+                const auto triangle = m_triangleIndices[i];
+                if (isRemoved(triangle))
+                    continue;
+                triangles.push_back(m_triangles.triangle(triangle));
+                triangleNumbers.push_back(triangle);
+                faceIndices.push_back(m_triangleFaces[triangle]);
+            }
+            // in their original order, like a full build would clip them
+            std::sort(faceIndices.begin(), faceIndices.end());
+            faceIndices.erase(std::unique(faceIndices.begin(), faceIndices.end()), faceIndices.end());
+        }
+        for (const auto triangle : cell.addedTriangles) {
+            triangles.push_back(update->m_addedTriangles[triangle]);
+            triangleNumbers.push_back(m_triangles.size() + triangle);
+        }
+
+        std::vector<Face> cellFaces;
+        const auto addFace = [&cellFaces, &cell, this](const Face &face) {
+            auto clipped = clip(face, cell.box, m_boundingBox);
+            if (!clipped.vertices.empty())
+                cellFaces.push_back(std::move(clipped));
+        };
+        for (const auto face : faceIndices)
+            addFace(faces[face]);
+        for (const auto face : cell.addedFaces)
+            addFace(addedFaces[face]);
+        // like in a full build, only children with faces exist
+        if (octant >= 0 && cellFaces.empty())
+            continue;
+
+        std::vector<uint32_t> triangleIndices(triangles.size());
+        std::iota(triangleIndices.begin(), triangleIndices.end(), 0);
+        const BuildContext context { leafParams, triangles };
+        auto root = initializeNode(cell.box, cellFaces, triangleIndices, context, cell.depth);
+        update->m_regions.push_back({ nodeIndex, octant, std::move(root), std::move(triangleNumbers) });
+    }
+
+    return update;
+}
+
+std::unique_ptr<Octree::Update> Octree::prepareBuild(const std::vector<Face> &faces, const BuildParams &params) const
+{
+    auto update = std::make_unique<Update>();
+    auto &tree = *(update->m_tree = std::make_unique<Octree>());
+    tree.setTriangleLayout(triangleLayout());
+    tree.build(faces, params, update->m_meshes);
+    tree.computeVisibility(update->m_meshes, params.visibilitySampleCount);
+    return update;
+}
+
+void Octree::applyUpdate(Update &update)
+{
+    using namespace OctreePrivate;
+
+    if (update.m_tree) {
+        auto &tree = *update.m_tree;
+        clear();
+        m_boundingBox = tree.m_boundingBox;
+        m_nodes = std::move(tree.m_nodes);
+        m_triangles = std::move(tree.m_triangles);
+        m_triangleIndices = std::move(tree.m_triangleIndices);
+        m_triangleFaces = std::move(tree.m_triangleFaces);
+        m_visibleMeshOffsets = std::move(tree.m_visibleMeshOffsets);
+        m_visibleMeshes = std::move(tree.m_visibleMeshes);
+        createMeshes(update.m_meshes);
+        return;
+    }
+
+    for (const auto triangle : update.m_removedTriangles) {
+        m_triangles.remove(triangle);
+        m_triangleFaces[triangle] = NoFace;
+    }
+    for (std::size_t i = 0; i < update.m_addedTriangles.size(); ++i) {
+        m_triangles.append(update.m_addedTriangles[i]);
+        m_triangleFaces.push_back(update.m_addedTriangleFaces[i]);
+    }
+
+    const auto nodeCount = static_cast<uint32_t>(m_nodes.size());
+    const auto meshCount = static_cast<uint32_t>(m_meshes.size());
+
+    // meshes of the replaced leaves, with the region replacing them
+    std::unordered_map<uint32_t, uint32_t> replacedMeshes;
+    {
+        std::unordered_map<uint32_t, uint32_t> replacedLeaves;
+        for (uint32_t i = 0; i < update.m_regions.size(); ++i) {
+            if (update.m_regions[i].octant < 0)
+                replacedLeaves[update.m_regions[i].node] = i;
+        }
+        for (uint32_t i = 0; i < meshCount; ++i) {
+            auto &mesh = m_meshes[i];
+            const auto it = replacedLeaves.find(mesh.leaf);
+            if (it != replacedLeaves.end()) {
+                mesh.mesh.reset();
+                mesh.leaf = NoNode;
+                replacedMeshes[i] = it->second;
+            }
+        }
+    }
+
+    // Adding a child moves its siblings to a new block; nodes that moved,
+    // by their first index, where they are now.
+    std::unordered_map<uint32_t, uint32_t> movedNodes;
+    const auto currentIndex = [&movedNodes](uint32_t node) {
+        const auto it = movedNodes.find(node);
+        return it != movedNodes.end() ? it->second : node;
+    };
+    // Nodes appended start with the visible set of the node they replace,
+    // or for the nodes under a new child, of its parent.
+    std::vector<uint32_t> visibilitySources;
+    const auto visibilitySource = [&visibilitySources, nodeCount](uint32_t node) {
+        return node < nodeCount ? node : visibilitySources[node - nodeCount];
+    };
+    std::vector<std::pair<uint32_t, uint32_t>> regionMeshes;
+    std::vector<MeshData> meshes;
+
+    for (auto &region : update.m_regions) {
+        auto nodeIndex = currentIndex(region.node);
+        const auto source = visibilitySource(nodeIndex);
+        if (region.octant >= 0) {
+            const auto parent = m_nodes[nodeIndex];
+            const auto childMask = static_cast<uint8_t>(parent.childMask | (1 << region.octant));
+            const auto first = static_cast<uint32_t>(m_nodes.size());
+            m_nodes.resize(m_nodes.size() + childOffset(childMask, 8));
+            visibilitySources.resize(m_nodes.size() - nodeCount, source);
+            for (int i = 0; i < 8; ++i) {
+                if ((parent.childMask & (1 << i)) == 0)
+                    continue;
+                const auto from = parent.first + childOffset(parent.childMask, i);
+                const auto to = first + childOffset(childMask, i);
+                m_nodes[to] = std::exchange(m_nodes[from], Node {});
+                visibilitySources[to - nodeCount] = visibilitySource(from);
+                for (auto &[original, current] : movedNodes) {
+                    if (current == from)
+                        current = to;
+                }
+                movedNodes.emplace(from, to);
+            }
+            m_nodes[nodeIndex].first = first;
+            m_nodes[nodeIndex].childMask = childMask;
+            nodeIndex = first + childOffset(childMask, region.octant);
+        }
+
+        const auto firstNewNode = static_cast<uint32_t>(m_nodes.size());
+        const auto firstIndex = m_triangleIndices.size();
+        const auto firstMesh = static_cast<uint32_t>(meshes.size());
+        compact(*region.root, nodeIndex, meshes);
+        for (auto i = firstIndex; i < m_triangleIndices.size(); ++i)
+            m_triangleIndices[i] = region.triangles[m_triangleIndices[i]];
+        visibilitySources.resize(m_nodes.size() - nodeCount, source);
+        regionMeshes.emplace_back(meshCount + firstMesh, meshCount + meshes.size());
+
+        // the new leaves reference triangles from all over, none of them
+        // can be tested by blocks
+        const auto shareTriangles = [this](uint32_t index) {
+            auto &node = m_nodes[index];
+            if (node.isLeaf())
+                node.sharedTriangleCount = std::min(node.triangleCount, MaxSharedTriangleCount);
+        };
+        shareTriangles(nodeIndex);
+        for (auto i = firstNewNode; i < m_nodes.size(); ++i)
+            shareTriangles(i);
+    }
+
+    for (auto &mesh : m_meshes) {
+        if (mesh.leaf != NoNode)
+            mesh.leaf = currentIndex(mesh.leaf);
+    }
+    for (auto &mesh : meshes)
+        mesh.leaf = currentIndex(mesh.leaf);
+#if DRAW_NODE_BOXES
+    m_boxMeshes.clear();
+#endif
+    createMeshes(meshes);
+
+    // the new meshes replace the old ones in the visible sets, the meshes of
+    // new children are visible from everywhere
+    if (!m_visibleMeshOffsets.empty()) {
+        std::vector<uint32_t> alwaysVisible;
+        for (std::size_t i = 0; i < update.m_regions.size(); ++i) {
+            if (update.m_regions[i].octant >= 0) {
+                for (auto mesh = regionMeshes[i].first; mesh < regionMeshes[i].second; ++mesh)
+                    alwaysVisible.push_back(mesh);
+            }
+        }
+        std::vector<uint32_t> visibleMeshOffsets { 0 };
+        std::vector<uint32_t> visibleMeshes;
+        std::vector<uint32_t> nodeRegions;
+        for (uint32_t node = 0; node < m_nodes.size(); ++node) {
+            const auto source = visibilitySource(node);
+            nodeRegions.clear();
+            for (auto i = m_visibleMeshOffsets[source]; i < m_visibleMeshOffsets[source + 1]; ++i) {
+                const auto mesh = m_visibleMeshes[i];
+                const auto it = replacedMeshes.find(mesh);
+                if (it == replacedMeshes.end()) {
+                    visibleMeshes.push_back(mesh);
+                } else if (std::find(nodeRegions.begin(), nodeRegions.end(), it->second) == nodeRegions.end()) {
+                    nodeRegions.push_back(it->second);
+                    for (auto newMesh = regionMeshes[it->second].first; newMesh < regionMeshes[it->second].second; ++newMesh)
+                        visibleMeshes.push_back(newMesh);
+                }
+            }
+            visibleMeshes.insert(visibleMeshes.end(), alwaysVisible.begin(), alwaysVisible.end());
+            visibleMeshOffsets.push_back(visibleMeshes.size());
+        }
+        m_visibleMeshOffsets = std::move(visibleMeshOffsets);
+        m_visibleMeshes = std::move(visibleMeshes);
+    }
+}
+
+namespace {
+// Mix of short segments (bullets) and long ones going through the whole box.
+std::vector<LineSegment> sampleSegments(const BoundingBox &box, int count)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const auto size = box.max - box.min;
+    const auto randomPoint = [&] {
+        return box.min + glm::vec3(unit(rng), unit(rng), unit(rng)) * size;
+    };
+    const auto shortLength = 0.02f * glm::length(size);
+
+    std::vector<LineSegment> segments;
+    segments.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        const auto from = randomPoint();
+        if (i % 2 == 0) {
+            segments.push_back({ from, randomPoint() });
+        } else {
+            const auto direction = glm::normalize(randomPoint() - from + glm::vec3(1e-3f));
+            segments.push_back({ from, from + shortLength * direction });
+        }
+    }
+    return segments;
+}
+} // namespace
+
+Octree::BuildParams Octree::tuneBuildParams(const std::vector<Face> &faces, const BuildParams &baseParams)
+{
+    using Clock = std::chrono::steady_clock;
+    constexpr auto SampleCount = 20000;
+    constexpr auto RunCount = 3;
+
+    auto best = baseParams;
+    if (faces.empty())
+        return best;
+
+    BoundingBox box;
+    for (const auto &face : faces) {
+        for (const auto &vertex : face.vertices)
+            box |= vertex.position;
+    }
+    const auto segments = sampleSegments(box, SampleCount);
+
+    auto bestTime = Clock::duration::max();
+    for (const std::size_t maxFacesPerLeaf : { 8, 12, 20, 32, 48 }) {
+        for (const auto traversalCost : { 0.0f, 1.0f, 4.0f }) {
+            auto params = baseParams;
+            params.maxFacesPerLeaf = maxFacesPerLeaf;
+            params.traversalCost = traversalCost;
+
+            Octree octree;
+            std::vector<OctreePrivate::MeshData> meshes;
+            octree.build(faces, params, meshes);
+
+            // best of a few runs, other processes only ever make it slower
+            auto time = Clock::duration::max();
+            for (int run = 0; run < RunCount; ++run) {
+                const auto start = Clock::now();
+                for (const auto &segment : segments)
+                    octree.findCollision(segment);
+                time = std::min(time, Clock::now() - start);
+            }
+
+            if (time < bestTime) {
+                bestTime = time;
+                best = params;
+            }
+        }
+    }
+    return best;
+}
+
+namespace {
+constexpr uint32_t BakedOctreeTag = 0x5254434f; // "OCTR"
+// bump whenever the layout or the build changes
+constexpr uint32_t BakedOctreeVersion = 5;
+} // namespace
+
+void Octree::write(DataWriter &dw, const std::vector<Face> &faces, const std::vector<const Material *> &materials, const BuildParams &params)
+{
+    Octree octree;
+    std::vector<OctreePrivate::MeshData> meshes;
+    octree.build(faces, params, meshes);
+    octree.computeVisibility(meshes, params.visibilitySampleCount);
+
+    dw << BakedOctreeTag << BakedOctreeVersion;
+    dw << octree.m_boundingBox.min << octree.m_boundingBox.max;
+
+    dw << static_cast<uint32_t>(octree.m_triangles.size());
+    for (std::size_t i = 0; i < octree.m_triangles.size(); ++i) {
+        const auto triangle = octree.m_triangles.triangle(i);
+        dw << triangle.v0 << triangle.v1 << triangle.v2;
+    }
+    dw << octree.m_triangleFaces;
+
+    dw << static_cast<uint32_t>(octree.m_nodes.size());
+    for (const auto &node : octree.m_nodes) {
+        dw << static_cast<uint8_t>(node.childMask);
+        if (!node.isLeaf()) {
+            dw << node.first;
+            continue;
+        }
+        dw << node.triangleCount << static_cast<uint32_t>(node.sharedTriangleCount);
+        for (auto i = node.first; i < node.first + node.triangleCount; ++i)
+            dw << octree.m_triangleIndices[i];
+    }
+
+    // debug geometry doesn't use any of the level materials and isn't baked
+    std::vector<std::pair<uint32_t, const OctreePrivate::MeshData *>> bakedMeshes;
+    constexpr auto NotBaked = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> bakedMeshIndices(meshes.size(), NotBaked);
+    for (std::size_t i = 0; i < meshes.size(); ++i) {
+        const auto &m = meshes[i];
+        const auto it = std::find(materials.begin(), materials.end(), m.material);
+        if (it != materials.end()) {
+            bakedMeshIndices[i] = bakedMeshes.size();
+            bakedMeshes.emplace_back(std::distance(materials.begin(), it), &m);
+        }
+    }
+    dw << static_cast<uint32_t>(bakedMeshes.size());
+    for (const auto &[materialIndex, m] : bakedMeshes) {
+        dw << static_cast<uint32_t>(m->primitive) << materialIndex << m->vertices << m->indices << m->leaf;
+    }
+
+    std::vector<uint32_t> visibleMeshOffsets, visibleMeshes;
+    if (!octree.m_visibleMeshOffsets.empty()) {
+        visibleMeshOffsets.push_back(0);
+        for (std::size_t node = 0; node < octree.m_nodes.size(); ++node) {
+            for (auto i = octree.m_visibleMeshOffsets[node]; i < octree.m_visibleMeshOffsets[node + 1]; ++i) {
+                const auto mesh = bakedMeshIndices[octree.m_visibleMeshes[i]];
+                if (mesh != NotBaked)
+                    visibleMeshes.push_back(mesh);
+            }
+            visibleMeshOffsets.push_back(visibleMeshes.size());
+        }
+    }
+    dw << visibleMeshOffsets << visibleMeshes;
+}
+
+bool Octree::read(DataStream &ds, const std::vector<const Material *> &materials)
+{
+    clear();
+
+    const auto fail = [this] {
+        clear();
+        return false;
+    };
+
+    uint32_t tag, version;
+    ds >> tag >> version;
+    if (!ds || tag != BakedOctreeTag || version != BakedOctreeVersion)
+        return fail();
+    ds >> m_boundingBox.min >> m_boundingBox.max;
+
+    // smallest sizes in the stream, to reject counts it can't hold
+    constexpr auto TriangleBytes = 9 * sizeof(float);
+    constexpr auto NodeBytes = sizeof(uint8_t) + sizeof(uint32_t);
+    constexpr auto MeshBytes = 5 * sizeof(uint32_t);
+
+    uint32_t triangleCount;
+    ds >> triangleCount;
+    if (!ds || triangleCount > ds.bytesLeft() / TriangleBytes)
+        return fail();
+    for (uint32_t i = 0; i < triangleCount && ds; ++i) {
+        Triangle triangle;
+        ds >> triangle.v0 >> triangle.v1 >> triangle.v2;
+        m_triangles.append(triangle);
+    }
+    ds >> m_triangleFaces;
+    if (!ds || (!m_triangleFaces.empty() && m_triangleFaces.size() != triangleCount))
+        return fail();
+
+    uint32_t nodeCount;
+    ds >> nodeCount;
+    if (!ds || nodeCount > ds.bytesLeft() / NodeBytes)
+        return fail();
+    m_nodes.resize(nodeCount);
+    for (uint32_t i = 0; i < nodeCount; ++i) {
+        auto &node = m_nodes[i];
+        uint8_t childMask;
+        ds >> childMask;
+        node.childMask = childMask;
+        if (!node.isLeaf()) {
+            ds >> node.first;
+            node.triangleCount = node.sharedTriangleCount = 0;
+            if (!ds || node.first <= i || node.first + OctreePrivate::childOffset(node.childMask, 8) > nodeCount)
+                return fail();
+            continue;
+        }
+        uint32_t sharedTriangleCount;
+        ds >> node.triangleCount >> sharedTriangleCount;
+        if (!ds || sharedTriangleCount > node.triangleCount || sharedTriangleCount > MaxSharedTriangleCount)
+            return fail();
+        node.sharedTriangleCount = sharedTriangleCount;
+        node.first = m_triangleIndices.size();
+        for (uint32_t j = 0; j < node.triangleCount && ds; ++j) {
+            uint32_t triangle;
+            ds >> triangle;
+            if (triangle >= triangleCount)
+                return fail();
+            // intersectLeaf tests the triangles the leaf owns as a range
+            if (j > sharedTriangleCount && triangle != m_triangleIndices.back() + 1)
+                return fail();
+            m_triangleIndices.push_back(triangle);
+        }
+        if (!ds)
+            return fail();
+    }
+
+    uint32_t meshCount;
+    ds >> meshCount;
+    if (!ds || meshCount > ds.bytesLeft() / MeshBytes)
+        return fail();
+    std::vector<OctreePrivate::MeshData> meshes(meshCount);
+    for (auto &m : meshes) {
+        uint32_t primitive, materialIndex;
+        ds >> primitive >> materialIndex >> m.vertices >> m.indices >> m.leaf;
+        if (!ds || materialIndex >= materials.size() || (m.leaf != NoNode && (m.leaf >= nodeCount || !m_nodes[m.leaf].isLeaf())))
+            return fail();
+        m.primitive = primitive;
+        m.material = materials[materialIndex];
+    }
+
+    ds >> m_visibleMeshOffsets >> m_visibleMeshes;
+    if (!ds)
+        return fail();
+    if (!m_visibleMeshOffsets.empty()) {
+        if (m_visibleMeshOffsets.size() != nodeCount + 1 || m_visibleMeshOffsets.front() != 0 || m_visibleMeshOffsets.back() != m_visibleMeshes.size())
+            return fail();
+        if (!std::is_sorted(m_visibleMeshOffsets.begin(), m_visibleMeshOffsets.end()))
+            return fail();
+        if (std::any_of(m_visibleMeshes.begin(), m_visibleMeshes.end(), [meshCount](uint32_t mesh) { return mesh >= meshCount; }))
+            return fail();
+    }
+
+    createMeshes(meshes);
+    return true;
+}
+
+void Octree::render(Renderer *renderer, const glm::mat4 &worldMatrix) const
+{
+#if DRAW_NODE_BOXES
+#if DEBUG_INTERSECTIONS
+    std::lock_guard lock(m_intersectedMutex);
+#endif
+    for (std::size_t i = 0; i < m_boxMeshes.size(); ++i) {
+#if DEBUG_INTERSECTIONS
+        if (!m_intersected[i])
+            continue;
+#endif
+        renderer->render(m_boxMeshes[i].get(), OctreePrivate::debugMaterial(), worldMatrix);
+    }
+#endif
+    for (auto &m : m_meshes) {
+        if (m.mesh)
+            renderer->render(m.mesh.get(), m.material, worldMatrix);
+    }
+}
+
+void Octree::render(Renderer *renderer, const glm::mat4 &worldMatrix, const glm::vec3 &viewpoint) const
+{
+    const auto node = m_visibleMeshOffsets.empty() ? NoNode : findNode(viewpoint);
+    if (node == NoNode) {
+        render(renderer, worldMatrix);
+        return;
+    }
+#if DRAW_NODE_BOXES
+    renderer->render(m_boxMeshes[node].get(), OctreePrivate::debugMaterial(), worldMatrix);
+#endif
+    for (auto i = m_visibleMeshOffsets[node]; i < m_visibleMeshOffsets[node + 1]; ++i) {
+        const auto &m = m_meshes[m_visibleMeshes[i]];
+        renderer->render(m.mesh.get(), m.material, worldMatrix);
+    }
+}
+
+std::size_t Octree::collisionMemoryUsage() const
+{
+    return m_nodes.size() * sizeof(Node) + m_triangles.memoryUsage() + m_triangleIndices.size() * sizeof(uint32_t);
+}
+
+BoundingBox Octree::boundingBox() const
+{
+    return m_boundingBox;
+}
+
+bool Octree::intersectLeaf(const Node &node, const Ray &ray, OctreePrivate::Mailbox &mailbox, float &t, bool anyHit, QueryStats *stats) const
+{
+    bool hit = false;
+
+    // The triangles first referenced by this leaf are consecutive, their
+    // blocks are tested as they are. Whatever else is in these blocks is
+    // tested along, which is wasted but harmless: any hit is a real one.
+    const auto ownedBegin = node.first + node.sharedTriangleCount;
+    const auto ownedEnd = node.first + node.triangleCount;
+    if (ownedBegin != ownedEnd) {
+        const auto firstBlock = m_triangleIndices[ownedBegin] / TriangleBlock::Size;
+        const auto lastBlock = m_triangleIndices[ownedEnd - 1] / TriangleBlock::Size;
+        if (stats)
+            stats->trianglesTested += ownedEnd - ownedBegin;
+        if (m_triangles.intersection(firstBlock, lastBlock - firstBlock + 1, ray, t, anyHit)) {
+            hit = true;
+            if (anyHit)
+                return true;
+        }
+        for (auto i = ownedBegin; i < ownedEnd; ++i)
+            mailbox.insert(m_triangleIndices[i]);
+    }
+
+    // the shared ones are gathered a block at a time, skipping those
+    // tested in other leaves already
+    std::array<uint32_t, TriangleBlock::Size> batch;
+    std::size_t batchSize = 0;
+    const auto testBatch = [&] {
+        if (stats)
+            stats->trianglesTested += batchSize;
+        if (m_triangles.indexedIntersection(batch.data(), batchSize, ray, t, anyHit))
+            hit = true;
+        batchSize = 0;
+    };
+
+    for (auto i = node.first; i < ownedBegin; ++i) {
+        const auto triangle = m_triangleIndices[i];
+        if (!mailbox.insert(triangle))
+            continue;
+        batch[batchSize++] = triangle;
+        if (batchSize == batch.size()) {
+            testBatch();
+            if (hit && anyHit)
+                return true;
+        }
+    }
+    if (batchSize != 0)
+        testBatch();
+    return hit;
+}
+
+struct Octree::SegmentQuery {
+    RayQuery ray; // tMax shrinks to the closest hit found so far
+    bool anyHit; // stop at the first hit instead of looking for the closest
     std::optional<float> collisionT;
-    m_root->findCollision(segment, tMin, tMax, collisionT);
-    if (!collisionT)
+    QueryStats *stats;
+    OctreePrivate::Mailbox mailbox;
+#if DEBUG_INTERSECTIONS
+    std::vector<bool> intersected;
+#endif
+
+    SegmentQuery(const LineSegment &segment, bool anyHit, QueryStats *stats)
+        : ray(segment)
+        , anyHit(anyHit)
+        , stats(stats)
+    {
+    }
+
+    bool done() const { return anyHit && collisionT; }
+};
+
+std::optional<glm::vec3> Octree::findCollision(const LineSegment &segment, QueryStats *stats) const
+{
+    SegmentQuery query(segment, false, stats);
+    findCollision(query);
+    if (!query.collisionT)
         return {};
-    return segment.pointAt(*collisionT);
+    return segment.pointAt(*query.collisionT);
+}
+
+bool Octree::intersectsAny(const LineSegment &segment, QueryStats *stats) const
+{
+    SegmentQuery query(segment, true, stats);
+    findCollision(query);
+    return query.collisionT.has_value();
+}
+
+void Octree::findCollision(SegmentQuery &query) const
+{
+    if (m_nodes.empty())
+        return;
+
+    // children are tested by their parent, the root has to be tested here
+    const auto &bb = m_boundingBox;
+    const auto t0 = query.ray.slabT(bb.min);
+    const auto t1 = query.ray.slabT(bb.max);
+    const auto tClose = glm::compMax(glm::min(t0, t1));
+    const auto tFar = glm::compMin(glm::max(t0, t1));
+    const auto intersects = tClose <= tFar && tClose <= query.ray.tMax && tFar >= 0.0f;
+#if DEBUG_INTERSECTIONS
+    query.intersected.assign(m_nodes.size(), false);
+    query.intersected[0] = intersects;
+    findCollision(0, query, t0, t1);
+    std::lock_guard lock(m_intersectedMutex);
+    m_intersected.swap(query.intersected);
+#else
+    if (intersects)
+        findCollision(0, query, t0, t1);
+#endif
+}
+
+void Octree::findCollision(uint32_t nodeIndex, SegmentQuery &query, const glm::vec3 &t0, const glm::vec3 &t1) const
+{
+    const auto &node = m_nodes[nodeIndex];
+    const auto &ray = query.ray;
+
+#if DEBUG_INTERSECTIONS
+    {
+        const auto &box = m_nodeBoxes[nodeIndex];
+        assertCompare(t0, ray.slabT(box.min));
+        assertCompare(t1, ray.slabT(box.max));
+    }
+#endif
+
+    if (query.stats)
+        ++query.stats->nodesVisited;
+
+    if (node.isLeaf()) {
+        auto t = query.collisionT ? *query.collisionT : std::nextafter(ray.tMax, 2.0f);
+        if (intersectLeaf(node, ray.ray, query.mailbox, t, query.anyHit, query.stats))
+            query.collisionT = query.ray.tMax = t;
+        return;
+    }
+
+    const auto tMid = 0.5f * (t0 + t1);
+    float tEnter[8];
+    const auto hitMask = OctreePrivate::childSlabTests(t0, tMid, t1, ray.tMax, tEnter) & node.childMask;
+#if DEBUG_INTERSECTIONS
+    // visit every child, to show which ones the ray enters
+    const auto visitMask = node.childMask;
+#else
+    const auto visitMask = hitMask;
+#endif
+
+    // Visiting octants in index order xor'ed with the direction sign bits is
+    // front to back: a ray can only move from one octant to another whose
+    // index (after the xor) has a superset of its bits.
+    for (int order = 0; order < 8; ++order) {
+        const auto i = order ^ query.ray.octant;
+        if ((visitMask & (1 << i)) == 0)
+            continue;
+
+        const auto childIndex = node.first + OctreePrivate::childOffset(node.childMask, i);
+#if DEBUG_INTERSECTIONS
+        query.intersected[childIndex] = (hitMask & (1 << i)) != 0;
+#else
+        // a hit in a child visited before may be closer than this one
+        if (tEnter[i] > query.ray.tMax)
+            continue;
+#endif
+
+        glm::vec3 childTMin, childTMax;
+
+        if ((i & 1) == 0) {
+            childTMin.x = t0.x;
+            childTMax.x = tMid.x;
+        } else {
+            childTMin.x = tMid.x;
+            childTMax.x = t1.x;
+        }
+
+        if ((i & 2) == 0) {
+            childTMin.y = t0.y;
+            childTMax.y = tMid.y;
+        } else {
+            childTMin.y = tMid.y;
+            childTMax.y = t1.y;
+        }
+
+        if ((i & 4) == 0) {
+            childTMin.z = t0.z;
+            childTMax.z = tMid.z;
+        } else {
+            childTMin.z = tMid.z;
+            childTMax.z = t1.z;
+        }
+
+        findCollision(childIndex, query, childTMin, childTMax);
+        if (query.done())
+            return;
+    }
+}
+
+void Octree::findCollisions(const std::vector<LineSegment> &segments, std::vector<std::optional<glm::vec3>> &collisions, QueryStats *stats) const
+{
+    collisions.resize(segments.size());
+    std::transform(segments.begin(), segments.end(), collisions.begin(), [this, stats](const LineSegment &segment) {
+        return findCollision(segment, stats);
+    });
+}
+
+struct Octree::SweepQuery {
+    RayQuery ray; // path of the shape's center, tMax shrinks to the closest hit so far
+    glm::vec3 extent; // the shape can't reach anything outside node boxes grown by this
+    BoundingBox sweptBox; // everything the shape covers along the way
+    std::optional<SweepHit> hit;
+    OctreePrivate::Mailbox mailbox;
+
+    SweepQuery(const glm::vec3 &center, const glm::vec3 &extent, const glm::vec3 &motion)
+        : ray(Ray { center, motion }, 1.0f)
+        , extent(extent)
+        , sweptBox(BoundingBox { center - extent, center + extent } | BoundingBox { center + motion - extent, center + motion + extent })
+    {
+    }
+};
+
+std::optional<SweepHit> Octree::sweepSphere(const glm::vec3 &center, float radius, const glm::vec3 &motion) const
+{
+    if (m_nodes.empty())
+        return {};
+    SweepQuery query(center, glm::vec3(radius), motion);
+    sweep(0, m_boundingBox, query, [&](const Triangle &triangle) {
+        return triangle.sweep(center, radius, motion);
+    });
+    return query.hit;
+}
+
+std::optional<SweepHit> Octree::sweepCapsule(const Capsule &capsule, const glm::vec3 &motion) const
+{
+    if (m_nodes.empty())
+        return {};
+    const auto center = 0.5f * (capsule.a + capsule.b);
+    const auto extent = 0.5f * glm::abs(capsule.b - capsule.a) + capsule.radius;
+    SweepQuery query(center, extent, motion);
+    sweep(0, m_boundingBox, query, [&](const Triangle &triangle) {
+        return triangle.sweep(capsule, motion);
+    });
+    return query.hit;
+}
+
+template<typename SweepTriangle>
+void Octree::sweep(uint32_t nodeIndex, const BoundingBox &box, SweepQuery &query, const SweepTriangle &sweepTriangle) const
+{
+    const auto &node = m_nodes[nodeIndex];
+
+    if (!query.ray.intersects(BoundingBox { box.min - query.extent, box.max + query.extent }))
+        return;
+
+    if (node.isLeaf()) {
+        for (auto i = node.first; i < node.first + node.triangleCount; ++i) {
+            const auto index = m_triangleIndices[i];
+            if (!query.mailbox.insert(index))
+                continue;
+            const auto triangle = m_triangles.triangle(index);
+            const auto triangleBox = BoundingBox {} | triangle.v0 | triangle.v1 | triangle.v2;
+            if (!triangleBox.intersects(query.sweptBox))
+                continue;
+            const auto hit = sweepTriangle(triangle);
+            if (hit && (!query.hit || hit->t < query.hit->t)) {
+                query.hit = hit;
+                query.ray.tMax = hit->t;
+            }
+        }
+        return;
+    }
+
+    for (int order = 0; order < 8; ++order) {
+        const auto i = order ^ query.ray.octant;
+        if ((node.childMask & (1 << i)) != 0)
+            sweep(node.first + OctreePrivate::childOffset(node.childMask, i), OctreePrivate::childBox(box, i), query, sweepTriangle);
+    }
+}
+
+struct Octree::ClosestPointQuery {
+    glm::vec3 point;
+    float maxDistance2; // shrinks to the squared distance of the closest point so far
+    std::optional<glm::vec3> closest;
+    QueryStats *stats;
+    OctreePrivate::Mailbox mailbox;
+    // nodes left to visit, as a min-heap on their squared distance
+    struct Entry {
+        float distance2;
+        uint32_t nodeIndex;
+        BoundingBox box;
+        bool operator<(const Entry &other) const { return distance2 > other.distance2; }
+    };
+    std::vector<Entry> heap;
+
+    void reset(const glm::vec3 &point, float maxDistance)
+    {
+        this->point = point;
+        maxDistance2 = maxDistance * maxDistance;
+        closest.reset();
+        mailbox = {};
+        heap.clear();
+    }
+};
+
+std::optional<glm::vec3> Octree::closestPoint(const glm::vec3 &point, float maxDistance, QueryStats *stats) const
+{
+    ClosestPointQuery query;
+    query.stats = stats;
+    query.reset(point, maxDistance);
+    closestPoint(query);
+    return query.closest;
+}
+
+void Octree::closestPoints(const std::vector<glm::vec3> &points, float maxDistance, std::vector<std::optional<glm::vec3>> &closest, QueryStats *stats) const
+{
+    closest.resize(points.size());
+    ClosestPointQuery query;
+    query.stats = stats;
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        query.reset(points[i], maxDistance);
+        closestPoint(query);
+        closest[i] = query.closest;
+    }
+}
+
+void Octree::closestPoint(ClosestPointQuery &query) const
+{
+    if (m_nodes.empty())
+        return;
+
+    const auto distance2 = [&point = query.point](const BoundingBox &box) {
+        const auto d = glm::clamp(point, box.min, box.max) - point;
+        return glm::dot(d, d);
+    };
+
+    // Best first: nodes are visited closest first, so the search stops as
+    // soon as the closest node left is further than the closest point found.
+    auto &heap = query.heap;
+    const auto push = [&heap](const ClosestPointQuery::Entry &entry) {
+        heap.push_back(entry);
+        std::push_heap(heap.begin(), heap.end());
+    };
+    if (const auto d2 = distance2(m_boundingBox); d2 <= query.maxDistance2)
+        push({ d2, 0, m_boundingBox });
+
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end());
+        const auto entry = heap.back();
+        heap.pop_back();
+        if (entry.distance2 > query.maxDistance2)
+            break;
+
+        if (query.stats)
+            ++query.stats->nodesVisited;
+
+        const auto &node = m_nodes[entry.nodeIndex];
+        if (!node.isLeaf()) {
+            for (int i = 0; i < 8; ++i) {
+                if ((node.childMask & (1 << i)) == 0)
+                    continue;
+                const auto childBox = OctreePrivate::childBox(entry.box, i);
+                if (const auto d2 = distance2(childBox); d2 <= query.maxDistance2)
+                    push({ d2, node.first + OctreePrivate::childOffset(node.childMask, i), childBox });
+            }
+            continue;
+        }
+
+        for (auto i = node.first; i < node.first + node.triangleCount; ++i) {
+            const auto index = m_triangleIndices[i];
+            if (!query.mailbox.insert(index))
+                continue;
+            if (query.stats)
+                ++query.stats->trianglesTested;
+            const auto triangle = m_triangles.triangle(index);
+            const auto triangleBox = BoundingBox {} | triangle.v0 | triangle.v1 | triangle.v2;
+            if (distance2(triangleBox) > query.maxDistance2)
+                continue;
+            const auto p = triangle.closestPoint(query.point);
+            const auto d2 = glm::dot(p - query.point, p - query.point);
+            if (d2 <= query.maxDistance2) {
+                query.maxDistance2 = d2;
+                query.closest = p;
+            }
+        }
+    }
 }
@@ -1,15 +1,24 @@
 #pragma once
 
 #include "geometryutils.h"
+#include "packedtriangles.h"
 
 #include <glm/glm.hpp>
 
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 class Mesh;
 class Renderer;
 class Material;
+class DataStream;
+class DataWriter;
+
+#define DRAW_NODE_BOXES 0
+#define DEBUG_INTERSECTIONS 0
 
 struct Face {
     const Material *material;
@@ -21,8 +30,17 @@ struct Face {
     std::vector<Vertex> vertices;
 };
 
+std::vector<Triangle> triangulate(const std::vector<Face> &faces);
+
 namespace OctreePrivate {
-class Node;
+struct BuildContext;
+struct BuildNode;
+struct MeshData;
+struct Mailbox;
+struct UpdateRegion;
+namespace Morton {
+struct Node;
+}
 }
 
 struct Octree {
@@ -30,11 +48,218 @@ public:
     Octree();
     ~Octree();
 
+    // How leaves store their collision triangles: indices of the unclipped
+    // level triangles, each stored once, or copies of the faces clipped to
+    // the leaf, which take more memory but are a bit faster to test.
+    enum class TriangleStorage {
+        Referenced,
+        Clipped
+    };
+
+    // How the tree is built: top down, clipping the faces to each node, or
+    // bottom up from the Morton codes of the triangle centroids, which is much
+    // faster on large levels. Morton builds always reference the triangles
+    // and render the faces unclipped; they split nodes by the number of
+    // centroids they contain rather than the number of faces overlapping them.
+    enum class BuildMethod {
+        TopDown,
+        Morton
+    };
+
+    // The defaults suit small levels like the ones shipped with the game,
+    // tuneBuildParams finds better ones for a given level.
+    struct BuildParams {
+        BuildMethod method = BuildMethod::TopDown;
+        TriangleStorage storage = TriangleStorage::Referenced;
+        // nodes with at most this many faces are leaves
+        std::size_t maxFacesPerLeaf = 20;
+        int maxDepth = 20; // Morton builds stop at 21
+        // Cost of visiting a node, relative to testing a triangle. If it's
+        // positive, nodes are only split when the children are expected to
+        // be cheaper to query than the node's triangles.
+        float traversalCost = 0.0f;
+        // Rays cast from each cell of the tree to find the meshes that can be
+        // seen from it, 0 to skip computing the potentially visible sets.
+        int visibilitySampleCount = 0;
+    };
+
     void initialize(const std::vector<Face> &faces);
+    void initialize(const std::vector<Face> &faces, const BuildParams &params);
+
+    // Builds the octree with a few different leaf sizes and traversal costs,
+    // the rest taken from params, and returns the parameters that gave the
+    // fastest queries on random segments through the level. This builds the
+    // tree many times over, so it's meant to be used by offline tools.
+    static BuildParams tuneBuildParams(const std::vector<Face> &faces, const BuildParams &params);
+
+    // Baked octrees are stored at the end of level files so that loading a
+    // level doesn't have to run the build. Materials are stored as indices
+    // into the given list. write() doesn't create any GL objects, so that it
+    // can be used by offline tools; read() fails on malformed data or data
+    // written by an incompatible version.
+    static void write(DataWriter &dw, const std::vector<Face> &faces, const std::vector<const Material *> &materials, const BuildParams &params);
+    bool read(DataStream &ds, const std::vector<const Material *> &materials);
 
     void render(Renderer *renderer, const glm::mat4 &worldMatrix) const;
-    std::optional<glm::vec3> findCollision(const LineSegment &segment) const;
+    // Only renders the meshes potentially visible from the viewpoint, given
+    // in the octree's coordinates, if the sets were computed.
+    void render(Renderer *renderer, const glm::mat4 &worldMatrix, const glm::vec3 &viewpoint) const;
+    BoundingBox boundingBox() const;
+    std::size_t nodeCount() const { return m_nodes.size(); }
+    static constexpr std::size_t nodeSize() { return sizeof(Node); }
+    // bytes used by the nodes and the collision triangles
+    std::size_t collisionMemoryUsage() const;
+    // How the leaves store their collision triangles for ray tests, see
+    // TriangleLayout. Kept across builds, reads and updates.
+    void setTriangleLayout(TriangleLayout layout) { m_triangles.setLayout(layout); }
+    TriangleLayout triangleLayout() const { return m_triangles.layout(); }
+
+    struct QueryStats {
+        std::size_t nodesVisited = 0;
+        std::size_t trianglesTested = 0;
+    };
+
+    // Queries keep their state on the stack, so any number of threads can
+    // run them at once, as long as nothing modifies the tree meanwhile:
+    // initialize, read and applyUpdate need the queries to be done.
+
+    std::optional<glm::vec3> findCollision(const LineSegment &segment, QueryStats *stats = nullptr) const;
+    // Whether the segment hits anything at all; stops at the first hit.
+    bool intersectsAny(const LineSegment &segment, QueryStats *stats = nullptr) const;
+    // Same as calling findCollision for each segment. Traversing the tree
+    // once for packets of segments was tried, and was slower even for
+    // streams of bullets: they split up within a level or two, and the
+    // bookkeeping costs more than the single queries' slab tests.
+    void findCollisions(const std::vector<LineSegment> &segments, std::vector<std::optional<glm::vec3>> &collisions, QueryStats *stats = nullptr) const;
+    // First contact of a sphere or capsule moving by the given offset.
+    std::optional<SweepHit> sweepSphere(const glm::vec3 &center, float radius, const glm::vec3 &motion) const;
+    std::optional<SweepHit> sweepCapsule(const Capsule &capsule, const glm::vec3 &motion) const;
+    // Closest point of the level to the given one, if there's any within
+    // maxDistance. The batch form reuses the traversal state between points.
+    std::optional<glm::vec3> closestPoint(const glm::vec3 &point, float maxDistance, QueryStats *stats = nullptr) const;
+    void closestPoints(const std::vector<glm::vec3> &points, float maxDistance, std::vector<std::optional<glm::vec3>> &closest, QueryStats *stats = nullptr) const;
+
+    // Runtime edits of the geometry, for destroyed walls or opened doors.
+    // Faces are identified by their index in the list the tree was built
+    // from; the faces an update adds take the next indices and removed ones
+    // keep theirs. Only the leaves the edited faces overlap are rebuilt, the
+    // way a top-down build would build them, along with their meshes. Nodes
+    // and triangles they stop using are left in place until the next full
+    // build. Morton builds render chunks of faces rather than leaves and
+    // clipped triangles don't remember their faces, so only top-down builds
+    // with referenced triangles can be updated.
+    class Update
+    {
+    public:
+        Update();
+        ~Update();
+
+    private:
+        friend Octree;
+        std::vector<uint32_t> m_removedTriangles;
+        std::vector<Triangle> m_addedTriangles;
+        std::vector<uint32_t> m_addedTriangleFaces;
+        std::vector<OctreePrivate::UpdateRegion> m_regions; // replaced leaves first
+        // set instead of the above by prepareBuild
+        std::unique_ptr<Octree> m_tree;
+        std::vector<OctreePrivate::MeshData> m_meshes;
+    };
+    bool isUpdatable() const;
+    // Builds the new leaves and their mesh data without touching the tree, so
+    // it can run on a worker thread while the tree is queried and rendered,
+    // as long as no other update is applied meanwhile. faces are the ones the
+    // tree has now, removed ones included, and params those to build the new
+    // subtrees with. Null if the tree can't be updated or an added face
+    // sticks out of its bounding box.
+    std::unique_ptr<Update> prepareUpdate(const std::vector<Face> &faces, const std::vector<uint32_t> &removedFaces, const std::vector<Face> &addedFaces, const BuildParams &params) const;
+    // For edits prepareUpdate can't make: builds a whole new tree of the
+    // faces, with this one's triangle layout, on the same terms. Applying it
+    // replaces the tree.
+    std::unique_ptr<Update> prepareBuild(const std::vector<Face> &faces, const BuildParams &params) const;
+    // Swaps the new leaves in and uploads their meshes, on the GL thread.
+    void applyUpdate(Update &update);
 
 private:
-    std::unique_ptr<OctreePrivate::Node> m_root;
+    // Nodes are stored in a single array, children of an internal node are
+    // contiguous and only present for the octants set in childMask. Leaves
+    // reference a range of m_triangleIndices. Triangles are not clipped to
+    // the nodes, each is stored once and referenced from every leaf it
+    // overlaps; queries use a mailbox to test each of them only once.
+    // Triangles are numbered in the order leaves first reference them, the
+    // ones a leaf shares with leaves stored before it come first in its range
+    // and the others are consecutive. Leaves rebuilt by an update count all
+    // of theirs as shared.
+    // Node boxes aren't stored: the children of a node split its box in half
+    // along each axis, so traversals derive them from the root box.
+    struct Node {
+        uint32_t first; // first child (internal) or first triangle index (leaf)
+        uint32_t triangleCount;
+        uint32_t sharedTriangleCount : 24;
+        uint32_t childMask : 8; // 0 for leaf nodes
+        bool isLeaf() const { return childMask == 0; }
+    };
+    static constexpr uint32_t MaxSharedTriangleCount = (1u << 24) - 1;
+
+    void clear();
+    void build(const std::vector<Face> &faces, const BuildParams &params, std::vector<OctreePrivate::MeshData> &meshes);
+    void buildMorton(const BoundingBox &box, const std::vector<Face> &faces, const BuildParams &params, std::vector<OctreePrivate::MeshData> &meshes);
+    void compact(OctreePrivate::BuildNode &buildNode, uint32_t nodeIndex, std::vector<OctreePrivate::MeshData> &meshes);
+    void compact(const std::vector<OctreePrivate::Morton::Node> &mortonNodes, const std::vector<uint32_t> &leafTriangles, uint32_t mortonIndex, uint32_t nodeIndex);
+    // triangleFaces, if given, are the faces of the triangles to remember
+    void numberTriangles(const std::vector<Triangle> &triangles, const std::vector<uint32_t> &triangleFaces);
+    void computeVisibility(const std::vector<OctreePrivate::MeshData> &meshes, int sampleCount);
+    void createMeshes(const std::vector<OctreePrivate::MeshData> &meshes);
+    static constexpr uint32_t NoNode = std::numeric_limits<uint32_t>::max();
+    // the leaf containing the point, or the internal node if the child it
+    // would be in is missing
+    uint32_t findNode(const glm::vec3 &point) const;
+    template<typename F>
+    void forEachLeaf(const Triangle &triangle, F &&f) const;
+    // Same, but also calls f for the missing children of internal nodes the
+    // triangle overlaps: f(node, octant, box, depth) with the leaf and an
+    // octant of -1, or the parent and the octant of the missing child.
+    template<typename F>
+    void forEachCell(const Triangle &triangle, F &&f) const;
+    std::vector<BoundingBox> nodeBoxes() const;
+    bool intersectLeaf(const Node &node, const Ray &ray, OctreePrivate::Mailbox &mailbox, float &t, bool anyHit, QueryStats *stats) const;
+    struct SegmentQuery;
+    void findCollision(SegmentQuery &query) const;
+    // the ray enters the node, its parent (or the overload above for the root) tested it
+    void findCollision(uint32_t nodeIndex, SegmentQuery &query, const glm::vec3 &tMin, const glm::vec3 &tMax) const;
+    struct SweepQuery;
+    template<typename SweepTriangle>
+    void sweep(uint32_t nodeIndex, const BoundingBox &box, SweepQuery &query, const SweepTriangle &sweepTriangle) const;
+    struct ClosestPointQuery;
+    void closestPoint(ClosestPointQuery &query) const;
+
+    BoundingBox m_boundingBox;
+    std::vector<Node> m_nodes;
+    PackedTriangles m_triangles;
+    std::vector<uint32_t> m_triangleIndices;
+    // face of each triangle, for updates; empty if the tree can't be updated
+    std::vector<uint32_t> m_triangleFaces;
+    static constexpr uint32_t NoFace = std::numeric_limits<uint32_t>::max();
+    // Meshes of the leaves an update replaced are null, the new ones are
+    // appended.
+    struct MeshMaterial {
+        std::unique_ptr<Mesh> mesh;
+        const Material *material;
+        uint32_t leaf; // NoNode if the mesh isn't built from a single leaf
+    };
+    std::vector<MeshMaterial> m_meshes;
+    // Potentially visible sets: the meshes visible from the leaf or from the
+    // missing children of each node are a range of m_visibleMeshes. Both are
+    // empty if the sets weren't computed.
+    std::vector<uint32_t> m_visibleMeshOffsets;
+    std::vector<uint32_t> m_visibleMeshes;
+#if DRAW_NODE_BOXES
+    std::vector<std::unique_ptr<Mesh>> m_boxMeshes;
+#endif
+#if DEBUG_INTERSECTIONS
+    std::vector<BoundingBox> m_nodeBoxes;
+    // nodes the last segment query went through, for drawing them; queries
+    // mark them on their own copy and swap it in when they're done
+    mutable std::mutex m_intersectedMutex;
+    mutable std::vector<bool> m_intersected;
+#endif
 };
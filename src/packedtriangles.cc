@@ -0,0 +1,582 @@
+#include "packedtriangles.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+namespace {
+
+constexpr auto Epsilon = 1e-6f;
+
+// Moller-Trumbore, one lane at a time; same math as Triangle::intersection
+bool intersectScalar(const TriangleBlock *blocks, std::size_t blockCount, const Ray &ray, float &tBest, bool anyHit)
+{
+    const auto &o = ray.origin;
+    const auto &d = ray.direction;
+
+    auto hit = false;
+    for (auto block = blocks; block != blocks + blockCount; ++block) {
+        for (int i = 0; i < TriangleBlock::Size; ++i) {
+            const auto e1 = glm::vec3(block->e1[0][i], block->e1[1][i], block->e1[2][i]);
+            const auto e2 = glm::vec3(block->e2[0][i], block->e2[1][i], block->e2[2][i]);
+
+            const auto h = glm::cross(d, e2);
+            const auto a = glm::dot(e1, h);
+            if (std::fabs(a) < Epsilon)
+                continue;
+
+            const auto f = 1.0f / a;
+            const auto s = o - glm::vec3(block->v0[0][i], block->v0[1][i], block->v0[2][i]);
+            const auto u = f * glm::dot(s, h);
+            if (u < 0.0f || u > 1.0f)
+                continue;
+
+            const auto q = glm::cross(s, e1);
+            const auto v = f * glm::dot(d, q);
+            if (v < 0.0f || u + v > 1.0f)
+                continue;
+
+            const auto t = f * glm::dot(e2, q);
+            if (t < 0.0f || t >= tBest)
+                continue;
+
+            tBest = t;
+            hit = true;
+        }
+        if (anyHit && hit)
+            break;
+    }
+    return hit;
+}
+
+// Baldwin-Weber, one lane at a time. Padding lanes are all zeros, so t is
+// NaN and fails every comparison.
+bool intersectScalar(const ProjectedTriangleBlock *blocks, std::size_t blockCount, const Ray &ray, float &tBest, bool anyHit)
+{
+    const auto &d = ray.direction;
+
+    const auto row = [](const float (&row)[3][ProjectedTriangleBlock::Size], int i) {
+        return glm::vec3(row[0][i], row[1][i], row[2][i]);
+    };
+
+    auto hit = false;
+    for (auto block = blocks; block != blocks + blockCount; ++block) {
+        for (int i = 0; i < ProjectedTriangleBlock::Size; ++i) {
+            const auto s = ray.origin - row(block->v0, i);
+            const auto plane = row(block->plane, i);
+            const auto t = -glm::dot(plane, s) / glm::dot(plane, d);
+            if (!(t >= 0.0f && t < tBest))
+                continue;
+
+            // hit point relative to v0
+            const auto p = s + t * d;
+            const auto u = glm::dot(row(block->u, i), p);
+            if (u < 0.0f)
+                continue;
+            const auto v = glm::dot(row(block->v, i), p);
+            if (v < 0.0f || u + v > 1.0f)
+                continue;
+
+            tBest = t;
+            hit = true;
+        }
+        if (anyHit && hit)
+            break;
+    }
+    return hit;
+}
+
+#if HAVE_X86_KERNELS
+
+// SSE2 is part of the x86-64 baseline, so this one needs no target attribute.
+// Each block is processed as two 4-wide halves.
+bool intersectSSE(const TriangleBlock *blocks, std::size_t blockCount, const Ray &ray, float &tBest, bool anyHit)
+{
+    const auto ox = _mm_set1_ps(ray.origin.x);
+    const auto oy = _mm_set1_ps(ray.origin.y);
+    const auto oz = _mm_set1_ps(ray.origin.z);
+    const auto dx = _mm_set1_ps(ray.direction.x);
+    const auto dy = _mm_set1_ps(ray.direction.y);
+    const auto dz = _mm_set1_ps(ray.direction.z);
+    const auto zero = _mm_setzero_ps();
+    const auto one = _mm_set1_ps(1.0f);
+    const auto epsilon = _mm_set1_ps(Epsilon);
+    const auto signMask = _mm_set1_ps(-0.0f);
+
+    auto best = _mm_set1_ps(tBest);
+    for (auto block = blocks; block != blocks + blockCount; ++block) {
+        for (int half = 0; half < TriangleBlock::Size; half += 4) {
+            const auto e1x = _mm_load_ps(&block->e1[0][half]);
+            const auto e1y = _mm_load_ps(&block->e1[1][half]);
+            const auto e1z = _mm_load_ps(&block->e1[2][half]);
+            const auto e2x = _mm_load_ps(&block->e2[0][half]);
+            const auto e2y = _mm_load_ps(&block->e2[1][half]);
+            const auto e2z = _mm_load_ps(&block->e2[2][half]);
+
+            // h = cross(d, e2)
+            const auto hx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+            const auto hy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+            const auto hz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+
+            // a = dot(e1, h)
+            const auto a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)), _mm_mul_ps(e1z, hz));
+            auto mask = _mm_cmpge_ps(_mm_andnot_ps(signMask, a), epsilon);
+            const auto f = _mm_div_ps(one, a);
+
+            // s = o - v0
+            const auto sx = _mm_sub_ps(ox, _mm_load_ps(&block->v0[0][half]));
+            const auto sy = _mm_sub_ps(oy, _mm_load_ps(&block->v0[1][half]));
+            const auto sz = _mm_sub_ps(oz, _mm_load_ps(&block->v0[2][half]));
+
+            const auto u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)), _mm_mul_ps(sz, hz)));
+            mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+            // q = cross(s, e1)
+            const auto qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+            const auto qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+            const auto qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+
+            const auto v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)));
+            mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+            const auto t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)));
+            mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, best)));
+
+            if (_mm_movemask_ps(mask) == 0)
+                continue;
+
+            // closest hit in this half, broadcast to all lanes
+            auto tHit = _mm_or_ps(_mm_and_ps(mask, t), _mm_andnot_ps(mask, best));
+            tHit = _mm_min_ps(tHit, _mm_shuffle_ps(tHit, tHit, _MM_SHUFFLE(2, 3, 0, 1)));
+            tHit = _mm_min_ps(tHit, _mm_shuffle_ps(tHit, tHit, _MM_SHUFFLE(1, 0, 3, 2)));
+            best = tHit;
+        }
+        if (anyHit && _mm_cvtss_f32(best) < tBest)
+            break;
+    }
+
+    const auto t = _mm_cvtss_f32(best);
+    if (t < tBest) {
+        tBest = t;
+        return true;
+    }
+    return false;
+}
+
+bool intersectSSE(const ProjectedTriangleBlock *blocks, std::size_t blockCount, const Ray &ray, float &tBest, bool anyHit)
+{
+    const auto ox = _mm_set1_ps(ray.origin.x);
+    const auto oy = _mm_set1_ps(ray.origin.y);
+    const auto oz = _mm_set1_ps(ray.origin.z);
+    const auto dx = _mm_set1_ps(ray.direction.x);
+    const auto dy = _mm_set1_ps(ray.direction.y);
+    const auto dz = _mm_set1_ps(ray.direction.z);
+    const auto zero = _mm_setzero_ps();
+    const auto one = _mm_set1_ps(1.0f);
+    const auto signMask = _mm_set1_ps(-0.0f);
+
+    const auto dot = [](const float (&row)[3][ProjectedTriangleBlock::Size], int half, __m128 x, __m128 y, __m128 z) {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(&row[0][half]), x), _mm_mul_ps(_mm_load_ps(&row[1][half]), y)), _mm_mul_ps(_mm_load_ps(&row[2][half]), z));
+    };
+
+    auto best = _mm_set1_ps(tBest);
+    for (auto block = blocks; block != blocks + blockCount; ++block) {
+        for (int half = 0; half < ProjectedTriangleBlock::Size; half += 4) {
+            // s = o - v0
+            const auto sx = _mm_sub_ps(ox, _mm_load_ps(&block->v0[0][half]));
+            const auto sy = _mm_sub_ps(oy, _mm_load_ps(&block->v0[1][half]));
+            const auto sz = _mm_sub_ps(oz, _mm_load_ps(&block->v0[2][half]));
+
+            // t = -(plane . s) / (plane . d)
+            const auto t = _mm_xor_ps(_mm_div_ps(dot(block->plane, half, sx, sy, sz), dot(block->plane, half, dx, dy, dz)), signMask);
+            auto mask = _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, best));
+            if (_mm_movemask_ps(mask) == 0)
+                continue;
+
+            // hit point relative to v0
+            const auto px = _mm_add_ps(sx, _mm_mul_ps(t, dx));
+            const auto py = _mm_add_ps(sy, _mm_mul_ps(t, dy));
+            const auto pz = _mm_add_ps(sz, _mm_mul_ps(t, dz));
+            const auto u = dot(block->u, half, px, py, pz);
+            const auto v = dot(block->v, half, px, py, pz);
+            mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+            mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+
+            if (_mm_movemask_ps(mask) == 0)
+                continue;
+
+            auto tHit = _mm_or_ps(_mm_and_ps(mask, t), _mm_andnot_ps(mask, best));
+            tHit = _mm_min_ps(tHit, _mm_shuffle_ps(tHit, tHit, _MM_SHUFFLE(2, 3, 0, 1)));
+            tHit = _mm_min_ps(tHit, _mm_shuffle_ps(tHit, tHit, _MM_SHUFFLE(1, 0, 3, 2)));
+            best = tHit;
+        }
+        if (anyHit && _mm_cvtss_f32(best) < tBest)
+            break;
+    }
+
+    const auto t = _mm_cvtss_f32(best);
+    if (t < tBest) {
+        tBest = t;
+        return true;
+    }
+    return false;
+}
+
+__attribute__((target("avx2"))) bool intersectAVX2(const TriangleBlock *blocks, std::size_t blockCount, const Ray &ray, float &tBest, bool anyHit)
+{
+    const auto ox = _mm256_set1_ps(ray.origin.x);
+    const auto oy = _mm256_set1_ps(ray.origin.y);
+    const auto oz = _mm256_set1_ps(ray.origin.z);
+    const auto dx = _mm256_set1_ps(ray.direction.x);
+    const auto dy = _mm256_set1_ps(ray.direction.y);
+    const auto dz = _mm256_set1_ps(ray.direction.z);
+    const auto zero = _mm256_setzero_ps();
+    const auto one = _mm256_set1_ps(1.0f);
+    const auto epsilon = _mm256_set1_ps(Epsilon);
+    const auto signMask = _mm256_set1_ps(-0.0f);
+
+    auto best = _mm256_set1_ps(tBest);
+    for (auto block = blocks; block != blocks + blockCount; ++block) {
+        const auto e1x = _mm256_load_ps(block->e1[0]);
+        const auto e1y = _mm256_load_ps(block->e1[1]);
+        const auto e1z = _mm256_load_ps(block->e1[2]);
+        const auto e2x = _mm256_load_ps(block->e2[0]);
+        const auto e2y = _mm256_load_ps(block->e2[1]);
+        const auto e2z = _mm256_load_ps(block->e2[2]);
+
+        const auto hx = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+        const auto hy = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+        const auto hz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+
+        const auto a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, hx), _mm256_mul_ps(e1y, hy)), _mm256_mul_ps(e1z, hz));
+        auto mask = _mm256_cmp_ps(_mm256_andnot_ps(signMask, a), epsilon, _CMP_GE_OQ);
+        const auto f = _mm256_div_ps(one, a);
+
+        const auto sx = _mm256_sub_ps(ox, _mm256_load_ps(block->v0[0]));
+        const auto sy = _mm256_sub_ps(oy, _mm256_load_ps(block->v0[1]));
+        const auto sz = _mm256_sub_ps(oz, _mm256_load_ps(block->v0[2]));
+
+        const auto u = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, hx), _mm256_mul_ps(sy, hy)), _mm256_mul_ps(sz, hz)));
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+
+        const auto qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+        const auto qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+        const auto qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+
+        const auto v = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)));
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+
+        const auto t = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)));
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GE_OQ), _mm256_cmp_ps(t, best, _CMP_LT_OQ)));
+
+        if (_mm256_movemask_ps(mask) == 0)
+            continue;
+
+        auto tHit = _mm256_blendv_ps(best, t, mask);
+        tHit = _mm256_min_ps(tHit, _mm256_permute_ps(tHit, _MM_SHUFFLE(2, 3, 0, 1)));
+        tHit = _mm256_min_ps(tHit, _mm256_permute_ps(tHit, _MM_SHUFFLE(1, 0, 3, 2)));
+        tHit = _mm256_min_ps(tHit, _mm256_permute2f128_ps(tHit, tHit, 0x01));
+        best = tHit;
+        if (anyHit)
+            break;
+    }
+
+    const auto t = _mm256_cvtss_f32(best);
+    if (t < tBest) {
+        tBest = t;
+        return true;
+    }
+    return false;
+}
+
+__attribute__((target("avx2"))) bool intersectAVX2(const ProjectedTriangleBlock *blocks, std::size_t blockCount, const Ray &ray, float &tBest, bool anyHit)
+{
+    const auto ox = _mm256_set1_ps(ray.origin.x);
+    const auto oy = _mm256_set1_ps(ray.origin.y);
+    const auto oz = _mm256_set1_ps(ray.origin.z);
+    const auto dx = _mm256_set1_ps(ray.direction.x);
+    const auto dy = _mm256_set1_ps(ray.direction.y);
+    const auto dz = _mm256_set1_ps(ray.direction.z);
+    const auto zero = _mm256_setzero_ps();
+    const auto one = _mm256_set1_ps(1.0f);
+    const auto signMask = _mm256_set1_ps(-0.0f);
+
+    auto best = _mm256_set1_ps(tBest);
+    for (auto block = blocks; block != blocks + blockCount; ++block) {
+        const auto sx = _mm256_sub_ps(ox, _mm256_load_ps(block->v0[0]));
+        const auto sy = _mm256_sub_ps(oy, _mm256_load_ps(block->v0[1]));
+        const auto sz = _mm256_sub_ps(oz, _mm256_load_ps(block->v0[2]));
+
+        const auto planeX = _mm256_load_ps(block->plane[0]);
+        const auto planeY = _mm256_load_ps(block->plane[1]);
+        const auto planeZ = _mm256_load_ps(block->plane[2]);
+        const auto planeS = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(planeX, sx), _mm256_mul_ps(planeY, sy)), _mm256_mul_ps(planeZ, sz));
+        const auto planeD = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(planeX, dx), _mm256_mul_ps(planeY, dy)), _mm256_mul_ps(planeZ, dz));
+        const auto t = _mm256_xor_ps(_mm256_div_ps(planeS, planeD), signMask);
+        auto mask = _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GE_OQ), _mm256_cmp_ps(t, best, _CMP_LT_OQ));
+        if (_mm256_movemask_ps(mask) == 0)
+            continue;
+
+        const auto px = _mm256_add_ps(sx, _mm256_mul_ps(t, dx));
+        const auto py = _mm256_add_ps(sy, _mm256_mul_ps(t, dy));
+        const auto pz = _mm256_add_ps(sz, _mm256_mul_ps(t, dz));
+        const auto u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(block->u[0]), px), _mm256_mul_ps(_mm256_load_ps(block->u[1]), py)),
+                                     _mm256_mul_ps(_mm256_load_ps(block->u[2]), pz));
+        const auto v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(block->v[0]), px), _mm256_mul_ps(_mm256_load_ps(block->v[1]), py)),
+                                     _mm256_mul_ps(_mm256_load_ps(block->v[2]), pz));
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(v, zero, _CMP_GE_OQ)));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+
+        if (_mm256_movemask_ps(mask) == 0)
+            continue;
+
+        auto tHit = _mm256_blendv_ps(best, t, mask);
+        tHit = _mm256_min_ps(tHit, _mm256_permute_ps(tHit, _MM_SHUFFLE(2, 3, 0, 1)));
+        tHit = _mm256_min_ps(tHit, _mm256_permute_ps(tHit, _MM_SHUFFLE(1, 0, 3, 2)));
+        tHit = _mm256_min_ps(tHit, _mm256_permute2f128_ps(tHit, tHit, 0x01));
+        best = tHit;
+        if (anyHit)
+            break;
+    }
+
+    const auto t = _mm256_cvtss_f32(best);
+    if (t < tBest) {
+        tBest = t;
+        return true;
+    }
+    return false;
+}
+
+#endif
+
+const auto DefaultKernel = bestTriangleKernel();
+
+} // namespace
+
+bool isSupported(TriangleKernel kernel)
+{
+    switch (kernel) {
+    case TriangleKernel::Scalar:
+        return true;
+#if HAVE_X86_KERNELS
+    case TriangleKernel::SSE:
+        return true;
+    case TriangleKernel::AVX2:
+        // may run from a static initializer, before libgcc's own
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+TriangleKernel bestTriangleKernel()
+{
+    for (auto kernel : { TriangleKernel::AVX2, TriangleKernel::SSE }) {
+        if (isSupported(kernel))
+            return kernel;
+    }
+    return TriangleKernel::Scalar;
+}
+
+bool intersectTriangleBlocks(TriangleKernel kernel, const TriangleBlock *blocks, std::size_t blockCount, const Ray &ray, float &t, bool anyHit)
+{
+    switch (kernel) {
+#if HAVE_X86_KERNELS
+    case TriangleKernel::SSE:
+        return intersectSSE(blocks, blockCount, ray, t, anyHit);
+    case TriangleKernel::AVX2:
+        return intersectAVX2(blocks, blockCount, ray, t, anyHit);
+#endif
+    default:
+        return intersectScalar(blocks, blockCount, ray, t, anyHit);
+    }
+}
+
+bool intersectTriangleBlocks(TriangleKernel kernel, const ProjectedTriangleBlock *blocks, std::size_t blockCount, const Ray &ray, float &t, bool anyHit)
+{
+    switch (kernel) {
+#if HAVE_X86_KERNELS
+    case TriangleKernel::SSE:
+        return intersectSSE(blocks, blockCount, ray, t, anyHit);
+    case TriangleKernel::AVX2:
+        return intersectAVX2(blocks, blockCount, ray, t, anyHit);
+#endif
+    default:
+        return intersectScalar(blocks, blockCount, ray, t, anyHit);
+    }
+}
+
+void PackedTriangles::setLayout(TriangleLayout layout)
+{
+    m_layout = layout;
+    m_projectedBlocks.clear();
+    if (layout == TriangleLayout::Projected) {
+        m_projectedBlocks.resize(m_blocks.size());
+        for (std::size_t i = 0; i < m_projectedBlocks.size() * ProjectedTriangleBlock::Size; ++i)
+            project(i);
+    }
+}
+
+void PackedTriangles::clear()
+{
+    m_blocks.clear();
+    m_projectedBlocks.clear();
+    m_size = 0;
+}
+
+void PackedTriangles::append(const Triangle &triangle)
+{
+    const auto lane = m_size % TriangleBlock::Size;
+    if (lane == 0)
+        m_blocks.push_back({});
+    auto &block = m_blocks.back();
+    const auto e1 = triangle.v1 - triangle.v0;
+    const auto e2 = triangle.v2 - triangle.v0;
+    for (int i = 0; i < 3; ++i) {
+        block.v0[i][lane] = triangle.v0[i];
+        block.e1[i][lane] = e1[i];
+        block.e2[i][lane] = e2[i];
+    }
+    if (m_layout == TriangleLayout::Projected) {
+        if (lane == 0)
+            m_projectedBlocks.push_back({});
+        project(m_size);
+    }
+    ++m_size;
+}
+
+void PackedTriangles::project(std::size_t index)
+{
+    auto &block = m_projectedBlocks[index / ProjectedTriangleBlock::Size];
+    const auto lane = index % ProjectedTriangleBlock::Size;
+    const auto triangle = this->triangle(index);
+    const auto e1 = triangle.v1 - triangle.v0;
+    const auto e2 = triangle.v2 - triangle.v0;
+    const auto n = glm::cross(e1, e2);
+
+    // Divides by the largest component of the normal; the u and v rows then
+    // solve for the barycentric coordinates in the plane of the other two
+    // axes. Degenerate triangles and padding are left all zeros.
+    glm::vec3 u(0.0f), v(0.0f), plane(0.0f);
+    const auto axis = std::fabs(n.x) >= std::max(std::fabs(n.y), std::fabs(n.z)) ? 0 : std::fabs(n.y) >= std::fabs(n.z) ? 1 : 2;
+    if (n[axis] != 0.0f) {
+        const auto a = (axis + 1) % 3;
+        const auto b = (axis + 2) % 3;
+        const auto inverse = 1.0f / n[axis];
+        u[a] = e2[b] * inverse;
+        u[b] = -e2[a] * inverse;
+        v[a] = -e1[b] * inverse;
+        v[b] = e1[a] * inverse;
+        plane = n * inverse;
+    }
+    for (int i = 0; i < 3; ++i) {
+        block.v0[i][lane] = n[axis] != 0.0f ? triangle.v0[i] : 0.0f;
+        block.u[i][lane] = u[i];
+        block.v[i][lane] = v[i];
+        block.plane[i][lane] = plane[i];
+    }
+}
+
+void PackedTriangles::alignToBlock()
+{
+    m_size = m_blocks.size() * TriangleBlock::Size;
+}
+
+void PackedTriangles::remove(std::size_t index)
+{
+    auto &block = m_blocks[index / TriangleBlock::Size];
+    const auto lane = index % TriangleBlock::Size;
+    for (int i = 0; i < 3; ++i)
+        block.v0[i][lane] = block.e1[i][lane] = block.e2[i][lane] = 0.0f;
+    if (m_layout == TriangleLayout::Projected)
+        project(index);
+}
+
+std::size_t PackedTriangles::memoryUsage() const
+{
+    return m_blocks.size() * sizeof(TriangleBlock) + m_projectedBlocks.size() * sizeof(ProjectedTriangleBlock);
+}
+
+Triangle PackedTriangles::triangle(std::size_t index) const
+{
+    const auto &block = m_blocks[index / TriangleBlock::Size];
+    const auto lane = index % TriangleBlock::Size;
+    const auto v0 = glm::vec3(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+    const auto e1 = glm::vec3(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+    const auto e2 = glm::vec3(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+    return { v0, v0 + e1, v0 + e2 };
+}
+
+bool PackedTriangles::intersection(std::size_t firstBlock, std::size_t blockCount, const Ray &ray, float &t, bool anyHit) const
+{
+    if (m_layout == TriangleLayout::Projected)
+        return intersectTriangleBlocks(DefaultKernel, m_projectedBlocks.data() + firstBlock, blockCount, ray, t, anyHit);
+    return intersectTriangleBlocks(DefaultKernel, m_blocks.data() + firstBlock, blockCount, ray, t, anyHit);
+}
+
+namespace {
+
+// Gathers the triangles at the given indices into blocks and tests them. The
+// lanes left empty are all zeros, which is a degenerate triangle in both
+// layouts.
+template<typename Block, typename Gather>
+bool gatherAndIntersect(const uint32_t *indices, std::size_t count, const Ray &ray, float &t, bool anyHit, const Gather &gather)
+{
+    bool hit = false;
+    for (std::size_t first = 0; first < count; first += Block::Size) {
+        Block block {};
+        const auto laneCount = std::min<std::size_t>(count - first, Block::Size);
+        for (std::size_t lane = 0; lane < laneCount; ++lane)
+            gather(block, lane, indices[first + lane]);
+        if (intersectTriangleBlocks(DefaultKernel, &block, 1, ray, t, anyHit)) {
+            hit = true;
+            if (anyHit)
+                break;
+        }
+    }
+    return hit;
+}
+
+} // namespace
+
+bool PackedTriangles::indexedIntersection(const uint32_t *indices, std::size_t count, const Ray &ray, float &t, bool anyHit) const
+{
+    if (m_layout == TriangleLayout::Projected) {
+        return gatherAndIntersect<ProjectedTriangleBlock>(indices, count, ray, t, anyHit, [this](ProjectedTriangleBlock &block, std::size_t lane, uint32_t index) {
+            const auto &source = m_projectedBlocks[index / ProjectedTriangleBlock::Size];
+            const auto sourceLane = index % ProjectedTriangleBlock::Size;
+            for (int i = 0; i < 3; ++i) {
+                block.v0[i][lane] = source.v0[i][sourceLane];
+                block.u[i][lane] = source.u[i][sourceLane];
+                block.v[i][lane] = source.v[i][sourceLane];
+                block.plane[i][lane] = source.plane[i][sourceLane];
+            }
+        });
+    }
+    return gatherAndIntersect<TriangleBlock>(indices, count, ray, t, anyHit, [this](TriangleBlock &block, std::size_t lane, uint32_t index) {
+        const auto &source = m_blocks[index / TriangleBlock::Size];
+        const auto sourceLane = index % TriangleBlock::Size;
+        for (int i = 0; i < 3; ++i) {
+            block.v0[i][lane] = source.v0[i][sourceLane];
+            block.e1[i][lane] = source.e1[i][sourceLane];
+            block.e2[i][lane] = source.e2[i][sourceLane];
+        }
+    });
+}
+
+std::optional<float> PackedTriangles::intersection(const LineSegment &segment) const
+{
+    auto t = std::nextafter(1.0f, 2.0f);
+    if (!intersection(0, m_blocks.size(), segment.ray(), t))
+        return {};
+    return t;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "geometryutils.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Triangles in structure-of-arrays blocks, with the first vertex and the
+// two edges from it precomputed, so that a whole block can be tested
+// against a ray with SIMD instructions. Unused lanes hold degenerate
+// triangles that never intersect anything.
+struct TriangleBlock {
+    static constexpr auto Size = 8;
+
+    alignas(32) float v0[3][Size];
+    alignas(32) float e1[3][Size];
+    alignas(32) float e2[3][Size];
+};
+
+// Same triangles as the linear part of the transform that maps each one to
+// the unit triangle in the xy plane (Baldwin and Weber, "Fast Ray-Triangle
+// Intersections by Coordinate Transformation"), applied relative to the
+// first vertex. The plane row gives the distance to the triangle's plane,
+// from which t follows, and the u and v rows the barycentric coordinates of
+// the hit point: a test is a division and a few dot products, no cross
+// products. Working relative to the vertex rather than folding it into the
+// transform keeps the precision of large levels.
+struct ProjectedTriangleBlock {
+    static constexpr auto Size = TriangleBlock::Size;
+
+    alignas(32) float v0[3][Size];
+    alignas(32) float u[3][Size];
+    alignas(32) float v[3][Size];
+    alignas(32) float plane[3][Size];
+};
+
+// How PackedTriangles keeps the triangles for ray tests: the first vertex
+// and the edges, tested with Moller-Trumbore, or those plus the projected
+// form, which the tests use instead. That's more than twice the memory for
+// a cheaper test; the edges stay for everything else that needs the
+// vertices.
+enum class TriangleLayout {
+    Edges,
+    Projected
+};
+
+enum class TriangleKernel {
+    Scalar,
+    SSE,
+    AVX2
+};
+
+bool isSupported(TriangleKernel kernel);
+TriangleKernel bestTriangleKernel();
+
+// Finds the closest intersection in [0, t) of the ray with the triangles in
+// the given blocks. On a hit, updates t and returns true. With anyHit, stops
+// after the first block with a hit instead.
+bool intersectTriangleBlocks(TriangleKernel kernel, const TriangleBlock *blocks, std::size_t blockCount, const Ray &ray, float &t, bool anyHit = false);
+bool intersectTriangleBlocks(TriangleKernel kernel, const ProjectedTriangleBlock *blocks, std::size_t blockCount, const Ray &ray, float &t, bool anyHit = false);
+
+class PackedTriangles
+{
+public:
+    // The layout is kept by clear(); switching it converts the triangles
+    // already there.
+    void setLayout(TriangleLayout layout);
+    TriangleLayout layout() const { return m_layout; }
+
+    void clear();
+    void append(const Triangle &triangle);
+    // pads the last block so that the next triangle starts a new one
+    void alignToBlock();
+    // replaces the triangle with a degenerate one, which nothing intersects
+    void remove(std::size_t index);
+
+    std::size_t size() const { return m_size; }
+    std::size_t blockCount() const { return m_blocks.size(); }
+    const TriangleBlock *blocks() const { return m_blocks.data(); }
+    // empty unless the layout is Projected
+    const ProjectedTriangleBlock *projectedBlocks() const { return m_projectedBlocks.data(); }
+    std::size_t memoryUsage() const;
+    Triangle triangle(std::size_t index) const;
+
+    bool intersection(std::size_t firstBlock, std::size_t blockCount, const Ray &ray, float &t, bool anyHit = false) const;
+    // Same for the triangles at the given indices, gathered into blocks first.
+    bool indexedIntersection(const uint32_t *indices, std::size_t count, const Ray &ray, float &t, bool anyHit = false) const;
+    std::optional<float> intersection(const LineSegment &segment) const;
+
+private:
+    void project(std::size_t index);
+
+    TriangleLayout m_layout = TriangleLayout::Edges;
+    std::vector<TriangleBlock> m_blocks;
+    std::vector<ProjectedTriangleBlock> m_projectedBlocks;
+    std::size_t m_size = 0;
+};
@@ -9,6 +9,8 @@ constexpr auto PlayerEntityPath = "assets/meshes/player-ship.w3d";
 Player::Player(World *world)
     : GameObject(world, PlayerEntityPath)
 {
+    // roughly the hull, the wing tips stick out a bit
+    setCollisionCapsule({ glm::vec3(0, 0, -2), glm::vec3(0, 0, 2), 1.0f });
 }
 
 Player::~Player() = default;
@@ -23,7 +25,7 @@ void Player::update(float elapsed)
     };
 
     const auto move = [this](float offset) {
-        setPosition(position() + direction() * offset);
+        GameObject::move(direction() * offset);
     };
 
     const auto testInput = [inputState = m_world->inputState()](InputState flag) {
@@ -1,22 +1,30 @@
 #include "world.h"
 
+#include "benchmark.h"
 #include "camera.h"
 #include "entity.h"
 #include "foe.h"
 #include "level.h"
 #include "material.h"
 #include "mesh.h"
+#include "navgraph.h"
 #include "player.h"
 #include "renderer.h"
 #include "shadermanager.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
 
 #include <GL/glew.h>
 
 #include <glm/gtc/random.hpp>
 #include <glm/gtx/string_cast.hpp>
 
+#define BENCHMARK_LOOSE_OCTREE 0
+#define BENCHMARK_PATH_QUERIES 0
+#define BENCHMARK_CONCURRENT_QUERIES 0
+
 namespace {
 struct BulletState {
     glm::vec3 position;
@@ -27,6 +35,22 @@ struct BulletState {
 constexpr const auto MaxBullets = 200;
 constexpr const auto BulletSize = glm::vec2(0.1, 2);
 
+// radius of the ships' collision capsules
+constexpr const auto NavClearance = 1.0f;
+constexpr const auto NavMinCellSize = 1.0f;
+
+// Third person camera arm, in the player's frame: behind and a bit above.
+constexpr const auto CameraArmOffset = glm::vec3(0, 3, -8);
+// Radius of the sphere swept along the arm, large enough to keep the near
+// plane out of the walls.
+constexpr const auto CameraRadius = 0.25f;
+// How fast the arm grows back once the way is clear, per second. It
+// shortens at once, so the camera never goes through the geometry.
+constexpr const auto CameraArmRate = 4.0f;
+// The arm never gets shorter than this, so the camera doesn't end up on the
+// player's position, where it couldn't look at it.
+constexpr const auto MinCameraArmLength = 0.5f;
+
 std::unique_ptr<Mesh> makeBulletMesh()
 {
     auto mesh = std::make_unique<Mesh>(GL_POINTS);
@@ -50,23 +74,43 @@ const Material *bulletMaterial()
     static const auto material = Material(ShaderManager::Program::Billboard);
     return &material;
 }
+
+template<typename T>
+bool isReady(const std::future<T> &future)
+{
+    return future.valid() && future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
 } // namespace
 
 World::World()
     : m_shaderManager(new ShaderManager)
     , m_camera(new Camera)
     , m_renderer(new Renderer(m_shaderManager.get(), m_camera.get()))
-    , m_level(new Level)
     , m_player(new Player(this))
-    , m_foe(new Foe(this))
+    , m_level(new Level)
+    , m_navGraph(new NavGraph)
     , m_explosionEntity(new Entity)
     , m_bulletsMesh(makeBulletMesh())
+    , m_cameraArmLength(glm::length(CameraArmOffset))
 {
     m_level->load("assets/meshes/level.z3d");
     m_explosionEntity->load("assets/meshes/fireball.w3d");
 
-    m_foe->setPosition(glm::vec3(8.0, 0.0, 0.0));
-    m_foe->setRotation(glm::mat3(glm::rotate(glm::mat4(1), .5f, glm::normalize(glm::vec3(1.0f)))));
+    m_navGraph->initialize(*m_level, NavClearance, NavMinCellSize);
+    m_pathPlanner = std::make_unique<PathPlanner>(m_navGraph.get());
+
+    m_objectIndex = std::make_unique<LooseOctree<GameObject *>>(m_level->boundingBox());
+    spawnFoe(glm::vec3(8.0, 0.0, 0.0), glm::mat3(glm::rotate(glm::mat4(1), .5f, glm::normalize(glm::vec3(1.0f)))));
+
+#if BENCHMARK_LOOSE_OCTREE
+    benchmarkLooseOctree(m_level->boundingBox());
+#endif
+#if BENCHMARK_PATH_QUERIES
+    benchmarkPathQueries(*m_level, NavClearance, NavMinCellSize);
+#endif
+#if BENCHMARK_CONCURRENT_QUERIES
+    benchmarkConcurrentQueries(*m_level, *m_player);
+#endif
 
     glClearColor(0, 0, 0, 0);
     glEnable(GL_CULL_FACE);
@@ -92,15 +136,16 @@ void World::render() const
         m_camera->setCenter(playerPosition + playerDir);
         m_camera->setUp(playerUp);
     } else {
-        m_camera->setEye(glm::vec3(0, 0, 0));
+        const auto arm = playerRotation * CameraArmOffset;
+        m_camera->setEye(playerPosition + m_cameraArmLength * glm::normalize(arm));
         m_camera->setCenter(playerPosition);
-        m_camera->setUp(glm::vec3(0, 1, 0));
+        m_camera->setUp(playerRotation[1]);
     }
 
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     m_renderer->begin();
-    m_level->render(m_renderer.get());
+    m_level->render(m_renderer.get(), m_camera->eye());
     if (m_cameraMode == CameraMode::ThirdPerson) {
         m_player->render(m_renderer.get());
     }
@@ -118,7 +163,8 @@ void World::render() const
         m_bulletsMesh->setVertexData(bulletData.data());
         m_renderer->render(m_bulletsMesh.get(), bulletMaterial(), glm::mat4(1));
     }
-    m_foe->render(m_renderer.get());
+    for (const auto &entry : m_foes)
+        entry.foe->render(m_renderer.get());
     m_renderer->end();
 }
 
@@ -130,44 +176,92 @@ void World::update(InputState inputState, float elapsed)
     const auto toggleViewPressed = [](InputState inputState) {
         return (inputState & InputState::ToggleView) != InputState::None;
     };
-    if (toggleViewPressed(inputState) && !toggleViewPressed(prevInputState))
+    if (toggleViewPressed(inputState) && !toggleViewPressed(prevInputState)) {
         m_cameraMode = m_cameraMode == CameraMode::FirstPerson ? CameraMode::ThirdPerson : CameraMode::FirstPerson;
+        // the arm isn't updated in first person; starting it fully extended
+        // lets the sweep below shorten it at once instead of easing it out
+        // from a stale length
+        if (m_cameraMode == CameraMode::ThirdPerson)
+            m_cameraArmLength = glm::length(CameraArmOffset);
+    }
+
+    // Swaps in the level geometry edits that are done first, so the whole
+    // tick sees the same level. The navigation graph is then rebuilt on a
+    // worker thread, and the level isn't updated until it's done: it can't
+    // be queried during its update.
+    if (isReady(m_navGraphTask)) {
+        auto navGraph = m_navGraphTask.get();
+        m_pathPlanner = std::make_unique<PathPlanner>(navGraph.get());
+        m_navGraph = std::move(navGraph);
+    }
+    if (!m_navGraphTask.valid() && m_level->update()) {
+        m_navGraphTask = std::async(std::launch::async, [level = m_level.get()] {
+            auto navGraph = std::make_unique<NavGraph>();
+            navGraph->initialize(*level, NavClearance, NavMinCellSize);
+            return navGraph;
+        });
+    }
 
     updateBullets(elapsed);
     updateExplosions(elapsed);
     m_player->update(elapsed);
+    updateFoes(elapsed);
+    updateCameraArm(elapsed);
+}
+
+void World::updateCameraArm(float elapsed)
+{
+    if (m_cameraMode != CameraMode::ThirdPerson)
+        return;
+
+    // a single sphere sweep from the player to where the camera wants to be
+    const auto arm = m_player->rotation() * CameraArmOffset;
+    auto length = glm::length(arm);
+    if (const auto hit = m_level->sweepSphere(m_player->position(), CameraRadius, arm))
+        length = std::max(length * hit->t, MinCameraArmLength);
+
+    if (length < m_cameraArmLength)
+        m_cameraArmLength = length;
+    else
+        m_cameraArmLength += (length - m_cameraArmLength) * (1.0f - std::exp(-CameraArmRate * elapsed));
 }
 
 void World::updateBullets(float elapsed)
 {
-    const auto updateBullet = [this, elapsed](Bullet &bullet) {
+    const auto isExpired = [](const Bullet &bullet) { return bullet.lifetime < 0.0f; };
+
+    for (auto &bullet : m_bullets)
         bullet.lifetime -= elapsed;
-        if (bullet.lifetime < 0.0)
-            return false;
+    m_bullets.erase(std::remove_if(m_bullets.begin(), m_bullets.end(), isExpired), m_bullets.end());
+
+    // one level query per bullet, they're too short and spread out for a
+    // batched traversal to share any work, see Octree::findCollisions
+    for (auto &bullet : m_bullets) {
         const auto d = glm::normalize(bullet.velocity);
         const auto p0 = bullet.position - 0.5f * BulletSize.y * d;
         const auto p1 = bullet.position + 0.5f * BulletSize.y * d;
-        const auto segment = LineSegment { p0, p1 };
-        const auto collisionPosition = [this, &segment] {
-            if (auto position = m_level->findCollision(segment))
-                return position;
-            return m_foe->findCollision(segment);
-        }();
+        auto segment = LineSegment { p0, p1 };
+        auto collisionPosition = m_level->findCollision(segment);
+
+        // objects are only hit if they're in front of the level geometry
+        if (collisionPosition)
+            segment.to = *collisionPosition;
+        m_objectIndex->query(segment, [&segment, &collisionPosition](const GameObject *object) {
+            if (const auto position = object->findCollision(segment)) {
+                collisionPosition = position;
+                segment.to = *position;
+            }
+        });
+
         if (collisionPosition) {
             spawnExplosion(*collisionPosition);
-            return false;
+            bullet.lifetime = -1.0f; // expire it below
+            continue;
         }
         bullet.position += bullet.velocity;
-        return true;
-    };
-    auto it = m_bullets.begin();
-    while (it != m_bullets.end()) {
-        auto &bullet = *it;
-        if (!updateBullet(*it))
-            it = m_bullets.erase(it);
-        else
-            ++it;
     }
+
+    m_bullets.erase(std::remove_if(m_bullets.begin(), m_bullets.end(), isExpired), m_bullets.end());
 }
 
 void World::updateExplosions(float elapsed)
@@ -191,8 +285,30 @@ void World::spawnBullet(const glm::vec3 &position, const glm::vec3 &velocity, fl
     m_bullets.push_back({ position, velocity, duration });
 }
 
+bool World::findPath(const glm::vec3 &from, const glm::vec3 &to, std::vector<glm::vec3> &path)
+{
+    return m_pathPlanner->findPath(from, to, path);
+}
+
 void World::spawnExplosion(const glm::vec3 &position)
 {
     constexpr auto ExplosionDuration = 1.0;
     m_explosions.push_back({ position, ExplosionDuration });
 }
+
+void World::spawnFoe(const glm::vec3 &position, const glm::mat3 &rotation)
+{
+    auto foe = std::make_unique<Foe>(this);
+    foe->setPosition(position);
+    foe->setRotation(rotation);
+    const auto handle = m_objectIndex->insert(foe.get(), position, foe->boundingRadius());
+    m_foes.push_back({ std::move(foe), handle });
+}
+
+void World::updateFoes(float elapsed)
+{
+    for (auto &entry : m_foes) {
+        entry.foe->update(elapsed);
+        m_objectIndex->move(entry.handle, entry.foe->position(), entry.foe->boundingRadius());
+    }
+}
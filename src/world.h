@@ -1,9 +1,11 @@
 #pragma once
 
 #include "inputstate.h"
+#include "looseoctree.h"
 
 #include <glm/glm.hpp>
 
+#include <future>
 #include <memory>
 #include <vector>
 
@@ -14,7 +16,10 @@ class Mesh;
 class Level;
 class Camera;
 class Foe;
+class GameObject;
 class Player;
+class NavGraph;
+class PathPlanner;
 
 class World
 {
@@ -24,6 +29,8 @@ public:
 
     ShaderManager *shaderManager() { return m_shaderManager.get(); }
     InputState inputState() { return m_inputState; }
+    const Level *level() const { return m_level.get(); }
+    const Player *player() const { return m_player.get(); }
 
     void resize(int width, int height);
     void update(InputState inputState, float elapsed);
@@ -31,23 +38,37 @@ public:
 
     void spawnBullet(const glm::vec3 &position, const glm::vec3 &velocity, float duration);
 
+    // Waypoints for flying from one point to another around the level, see
+    // PathPlanner. False if there's no way through. Until the navigation
+    // graph is rebuilt after level edits, paths go around the level as it
+    // was before them.
+    bool findPath(const glm::vec3 &from, const glm::vec3 &to, std::vector<glm::vec3> &path);
+
 private:
     void updateBullets(float elapsed);
     void updateExplosions(float elapsed);
     void spawnExplosion(const glm::vec3 &center);
+    void spawnFoe(const glm::vec3 &position, const glm::mat3 &rotation);
+    void updateFoes(float elapsed);
+    void updateCameraArm(float elapsed);
 
     std::unique_ptr<ShaderManager> m_shaderManager;
     std::unique_ptr<Camera> m_camera;
     std::unique_ptr<Renderer> m_renderer;
     std::unique_ptr<Player> m_player;
-    std::unique_ptr<Foe> m_foe;
     std::unique_ptr<Level> m_level;
+    std::unique_ptr<NavGraph> m_navGraph;
+    std::unique_ptr<PathPlanner> m_pathPlanner;
+    std::future<std::unique_ptr<NavGraph>> m_navGraphTask; // rebuild after level edits
     std::unique_ptr<Entity> m_explosionEntity;
     std::unique_ptr<Mesh> m_bulletsMesh;
     enum class CameraMode {
         FirstPerson,
         ThirdPerson
     } m_cameraMode = CameraMode::ThirdPerson;
+    // Distance from the player to the third person camera along its arm,
+    // shortened when the level is in the way.
+    float m_cameraArmLength;
     InputState m_inputState;
     struct Explosion {
         glm::vec3 position;
@@ -60,4 +81,11 @@ private:
         float lifetime;
     };
     std::vector<Bullet> m_bullets;
+    // Game objects that bullets can hit, indexed by their bounding spheres.
+    std::unique_ptr<LooseOctree<GameObject *>> m_objectIndex;
+    struct FoeEntry {
+        std::unique_ptr<Foe> foe;
+        LooseOctree<GameObject *>::Handle handle;
+    };
+    std::vector<FoeEntry> m_foes;
 };